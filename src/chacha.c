@@ -0,0 +1,65 @@
+/* chacha - the ChaCha20 stream cipher block function
+ * State: 4 constant words, 8 key words, a 64-bit block counter
+ * (words 12, 13), and a 64-bit nonce (words 14, 15), all little
+ * endian. Since every block is computed from the state and its
+ * counter alone, the keystream can be produced at any position
+ * and by several threads at once.
+ * Reference: D. J. Bernstein, ChaCha, a variant of Salsa20, 2008.
+ */
+
+#include "common.h"
+
+#define ROTL(v,n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a,b,c,d) \
+  a += b; d ^= a; d = ROTL(d, 16); \
+  c += d; b ^= c; b = ROTL(b, 12); \
+  a += b; d ^= a; d = ROTL(d,  8); \
+  c += d; b ^= c; b = ROTL(b,  7)
+
+static uint32 getle(const unsigned char *p)
+{
+  return p[0] | (uint32) p[1] << 8 | (uint32) p[2] << 16 | (uint32) p[3] << 24;
+}
+
+/** Set up state st for the 32-byte key, nonce 0, counter 0 */
+void chachakey(uint32 st[16], const unsigned char key[32])
+{
+  int i;
+
+  st[0] = 0x61707865; st[1] = 0x3320646e; /* "expand 32-byte k" */
+  st[2] = 0x79622d32; st[3] = 0x6b206574;
+  for (i = 0; i < 8; i++) st[4+i] = getle(key + 4*i);
+  for (i = 12; i < 16; i++) st[i] = 0;
+}
+
+/** Compute keystream block number ctr of state st into out */
+void chachablock(const uint32 st[16], unsigned long ctr, unsigned char out[64])
+{
+  uint32 in[16], x[16];
+  int i;
+
+  for (i = 0; i < 16; i++) in[i] = st[i];
+  in[12] = ctr & 0xFFFFFFFFUL;
+  in[13] = (ctr >> 16) >> 16; /* in two steps: long may be 32 bits */
+  for (i = 0; i < 16; i++) x[i] = in[i];
+
+  for (i = 0; i < 10; i++) { /* 20 rounds: column, diagonal */
+    QR(x[0], x[4], x[ 8], x[12]);
+    QR(x[1], x[5], x[ 9], x[13]);
+    QR(x[2], x[6], x[10], x[14]);
+    QR(x[3], x[7], x[11], x[15]);
+    QR(x[0], x[5], x[10], x[15]);
+    QR(x[1], x[6], x[11], x[12]);
+    QR(x[2], x[7], x[ 8], x[13]);
+    QR(x[3], x[4], x[ 9], x[14]);
+  }
+
+  for (i = 0; i < 16; i++) {
+    x[i] += in[i];
+    out[4*i+0] = x[i] & 255;
+    out[4*i+1] = (x[i] >> 8) & 255;
+    out[4*i+2] = (x[i] >> 16) & 255;
+    out[4*i+3] = (x[i] >> 24) & 255;
+  }
+}
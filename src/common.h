@@ -1,5 +1,6 @@
 
 #include <limits.h>
+#include <sys/types.h>
 
 /* Return status */
 
@@ -12,6 +13,11 @@
 int scanlong(const char *s, long *vp);
 int scanuint(const char *s, unsigned int *vp);
 
+/* Zero-copy output into pipes (see zcopy.c) */
+
+int ispipe(int fd);
+size_t zsplice(int pfd, int fd, off_t off, size_t n);
+
 /* Additional types */
 
 /* Note: <stdint.h> has uint32_t and the like,
@@ -25,3 +31,8 @@ typedef unsigned long uint32;
 #else
 #error "Unsupported word size"
 #endif
+
+/* ChaCha20 keystream (see chacha.c) */
+
+void chachakey(uint32 st[16], const unsigned char key[32]);
+void chachablock(const uint32 st[16], unsigned long ctr, unsigned char out[64]);
@@ -1,5 +1,7 @@
 /* eol - convert end of lines
- * Usage: eol [-dmu] [files]
+ * Usage: eol [-dmu] [-bcnt] [-j n] [files]
+ *    or: eol -i [-r] [-dmu] [-bcnt] [-j n] files
+ *    or: eol -s [-r] [-dmu] [-j n] [files]
  * History:
  *   ujr/1999 created
  *   ujr/2002-07 added input and output buffering
@@ -7,13 +9,21 @@
  * License: GNU General Public License (GPL)
  */
 
+#define _XOPEN_SOURCE 700  /* for IOV_MAX, pwrite, mkstemp */
+
+#include <dirent.h>   /* opendir, readdir */
 #include <errno.h>    /* errno */
+#include <limits.h>   /* IOV_MAX */
 #include <stdio.h>
-#include <stdlib.h>   /* abort */
+#include <stdlib.h>   /* malloc */
 #include <string.h>   /* strerror */
 
 #include <fcntl.h>    /* O_RDONLY */
+#include <pthread.h>
 #include <unistd.h>   /* open, read, write, close */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <sys/uio.h>  /* writev */
 
 #include "common.h"
 
@@ -28,98 +38,931 @@
 #define CR 13   /* carriage return */
 #define LF 10   /* line feed */
 
-int getch(int fd);
-int putch(int ch);
-int puteol(int type);
-int convert(int fd, int type);
+#define IOSIZE 65536  /* size of input and output buffers */
+#define CHUNKSIZE (4L*1024*1024)  /* unit of parallel conversion */
+#define SPLICEMIN 65536  /* splice unchanged runs at least this long */
+#define MAXJOBS 64    /* max threads for -j */
+#define BINCHECK 8000 /* files with NUL in so many bytes are binary */
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define NIOV IOV_MAX
+#else
+#define NIOV 1024     /* max iovecs per writev(2) */
+#endif
+
+enum { A, B, C };   /* FSM states */
+enum { KEEP, DROP, REPLACE, PAIR };   /* what to do with a CR or LF */
+
+/* Normalizations applied along with the conversion */
+#define NOBOM   1   /* -b: remove UTF-8 byte order mark */
+#define SQUEEZE 2   /* -c: collapse repeated blank lines */
+#define FINAL   4   /* -n: end last line with an EOL */
+#define TRIM    8   /* -t: remove blanks at end of lines */
+
+struct conv {         /* conversion state, carried across buffers */
+  int style;          /* target style: u, m, or d */
+  const char *eol;    /* EOL in target style */
+  size_t eollen;      /* length of eol */
+  int opts;           /* normalizations, see above */
+  int state;          /* FSM state: A, B, or C */
+  int bom;            /* BOM bytes held back, -1 once past start */
+  int bol;            /* no part of current line written */
+  int blank;          /* previous line was blank */
+  char *ws;           /* blanks held back at end of buffer */
+  size_t nws, maxws;  /* bytes in ws, size of ws */
+};
+
+/* Converted output goes to a sink: either copied into a buffer
+ * (putbuf), or, if the input is mapped into memory and stays there
+ * until the sink is flushed, gathered as pointers into the input
+ * (putiov) so that unchanged runs are never copied, or, if the
+ * output is a pipe, long unchanged runs even spliced from the input
+ * file (putspl), or just
+ * counted (putcnt) to learn the size of the output, or checked
+ * (putchk) to learn whether conversion would change anything.
+ */
+struct sink {
+  int (*put)(struct sink *sk, const char *s, size_t n);
+  int fd;             /* output file descriptor */
+  off_t off;          /* pwrite offset (or byte count), -1 to write */
+  char *buf;          /* output buffer for putbuf */
+  size_t len, size;   /* bytes in buf, size of buf */
+  struct iovec *iov;  /* output vector for putiov */
+  int niov;           /* entries used in iov */
+  int ifd;            /* input file for putspl */
+  const char *map;    /* its mapping ... */
+  size_t mapsize;     /* ... and size */
+  off_t mapoff;       /* file offset of map */
+  const char *next;   /* where unchanged output continues (putchk) */
+};
+
+struct census {       /* line ends found in a file (-s), as the FSM sees them */
+  unsigned long lf;   /* number of LF not paired with a CR */
+  unsigned long crlf; /* number of CR LF pairs */
+  unsigned long cr;   /* number of CR not paired with a LF */
+  unsigned long lfcr; /* number of LF CR pairs */
+  int state;          /* FSM state after the last byte seen */
+  int binary;         /* file looks binary, nothing counted */
+};
+
+int putbuf(struct sink *sk, const char *s, size_t n);
+int putiov(struct sink *sk, const char *s, size_t n);
+int putspl(struct sink *sk, const char *s, size_t n);
+int putcnt(struct sink *sk, const char *s, size_t n);
+int putchk(struct sink *sk, const char *s, size_t n);
+int flushsink(struct sink *sk);
+int writeiov(int fd, struct iovec *iov, int n);
+const char *findeol(const char *p, const char *end);
+void convinit(struct conv *cv, int style);
+int fsm(struct conv *cv, const char *p, const char *end);
+int convbuf(const char *s, size_t n, struct conv *cv, struct sink *sk);
+int normbuf(const char *s, size_t n, struct conv *cv, struct sink *sk);
+int hold(struct conv *cv, const char *s, size_t n);
+int convend(struct conv *cv, struct sink *sk);
+size_t chunkstart(const char *p, size_t size, size_t i);
+void *worker(void *arg);
+int convpar(const char *p, size_t size, int style);
+int convmap(int fd, off_t off, size_t size, int style);
+int convert(int fd, int style);
+char *tmpname(const char *fn);
+int rewrite(const char *fn, int style);
+void *fileworker(void *arg);
+int addpath(const char *path);
+void collect(const char *path, int recurse, int depth);
+int convfiles(int style);
+void tally(const char *s, size_t n, struct census *cp);
+int census(int fd, struct census *cp);
+int countfile(const char *fn, struct census *cp);
+const char *stylename(const struct census *cp);
+int needsconv(const struct census *cp, int style);
+int report(const struct census *cp, const char *name);
+int usage(void);
+
+/* Parallel conversion: the input is cut into chunks, each starting
+ * right after a plain byte (so the FSM is in state A there, as it
+ * is at the start of the input) and converted independently. The
+ * first pass counts the output of each chunk, the second pass
+ * converts and pwrites each chunk at its now known offset.
+ */
+struct job {
+  const char *p;      /* mapped input */
+  size_t size;        /* size of input */
+  int style;          /* target style */
+  int pass;           /* 1: count output, 2: convert and write */
+  size_t nchunks;     /* number of chunks */
+  size_t next;        /* next chunk to do */
+  off_t *offs;        /* output size, then offset, of each chunk */
+  int errnum;         /* errno of first failure, 0 if none */
+  pthread_mutex_t lock;
+};
+
+static const char *me = "eol";
+static unsigned njobs = 1;
+static int opts = 0;
+
+/* Work list for in-place conversion (-i) and census (-s) */
+static char **paths = 0;
+static size_t npaths = 0, maxpaths = 0, nextpath = 0;
+static struct census *counts = 0; /* per path, for census */
+static int nfail = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+int putbuf(struct sink *sk, const char *s, size_t n)
+{ /* buffered writing to sk->fd */
+  if (sk->len + n > sk->size) {
+    if (flushsink(sk) == EOF) return EOF;
+    if (n >= sk->size) { /* too large to buffer: write through */
+      if (sk->off < 0) return write(sk->fd, s, n) == (ssize_t) n ? 0 : EOF;
+      if (pwrite(sk->fd, s, n, sk->off) != (ssize_t) n) return EOF;
+      sk->off += n;
+      return 0; /* ok */
+    }
+  }
+  memcpy(sk->buf + sk->len, s, n);
+  sk->len += n;
+  return 0; /* ok */
+}
+
+int putcnt(struct sink *sk, const char *s, size_t n)
+{ /* count output bytes, discard output */
+  (void) s; /* unused */
+  sk->off += n;
+  return 0; /* ok */
+}
+
+int putchk(struct sink *sk, const char *s, size_t n)
+{ /* fail as soon as output deviates from input at sk->next */
+  if (s != sk->next) return EOF;
+  sk->next += n;
+  return 0; /* ok */
+}
 
-int getch(int fd)
-{ /* return next byte or EOF on end-of-file or error */
-  static char buf[BUFSIZ];
-  static char *bufp = buf;
-  static ssize_t n = 0;
+int putiov(struct sink *sk, const char *s, size_t n)
+{ /* gather s for writev; s must stay valid until flushed */
+  struct iovec *last = sk->iov + sk->niov - 1;
 
-  if (fd < 0) { /* flush buffer */
-    n = 0;
+  if (n == 0) return 0;
+  if (sk->niov > 0 && (char *) last->iov_base + last->iov_len == s) {
+    last->iov_len += n; /* contiguous with previous: extend */
     return 0;
   }
-  if (n <= 0) { /* buffer empty */
-      n = read(fd, buf, sizeof buf);
-      if (n <= 0) return EOF;
-      bufp = buf;
+  if (sk->niov == NIOV && flushsink(sk) == EOF) return EOF;
+  sk->iov[sk->niov].iov_base = (char *) s;
+  sk->iov[sk->niov].iov_len = n;
+  sk->niov += 1;
+  return 0; /* ok */
+}
+
+int putspl(struct sink *sk, const char *s, size_t n)
+{ /* like putiov, but once the last gathered run is long and
+     from the input file, splice it instead of writing it */
+  struct iovec *last;
+  size_t m;
+
+  if (putiov(sk, s, n) == EOF) return EOF;
+  last = sk->iov + sk->niov - 1;
+  if (sk->niov == 0 || last->iov_len < SPLICEMIN) return 0;
+  s = last->iov_base; n = last->iov_len;
+  if (s < sk->map || s + n > sk->map + sk->mapsize) return 0;
+
+  sk->niov--; /* write the runs before, then splice */
+  if (flushsink(sk) == EOF) return EOF;
+  if ((m = zsplice(sk->fd, sk->ifd, sk->mapoff + (s - sk->map), n)) < n) {
+    sk->put = putiov; /* cannot splice: stop trying */
+    if (write(sk->fd, s + m, n - m) != (ssize_t) (n - m)) return EOF;
+  }
+  return 0; /* ok */
+}
+
+int flushsink(struct sink *sk)
+{ /* write pending output to sk->fd */
+  if (sk->niov > 0 && writeiov(sk->fd, sk->iov, sk->niov) == EOF) return EOF;
+  if (sk->len > 0) {
+    if (sk->off < 0) {
+      if (write(sk->fd, sk->buf, sk->len) != (ssize_t) sk->len) return EOF;
+    }
+    else {
+      if (pwrite(sk->fd, sk->buf, sk->len, sk->off) != (ssize_t) sk->len)
+        return EOF;
+      sk->off += sk->len;
+    }
   }
-  n -= 1;
-  return (unsigned char) *bufp++;
+  sk->niov = 0;
+  sk->len = 0;
+  return 0; /* ok */
 }
 
-int putch(int ch)
-{ /* buffered writing to stdout */
-  static char buf[BUFSIZ];
-  static int n = 0;
+int writeiov(int fd, struct iovec *iov, int n)
+{ /* writev all of iov, resuming after short writes */
+  ssize_t r;
 
-  if (n == sizeof buf || (ch == EOF && n > 0)) {
-      if (write(1, buf, n) != n) return EOF;
-      n = 0;
-      if (ch == EOF) return 0; /* ok */
+  while (n > 0) {
+    if ((r = writev(fd, iov, n)) < 0) return EOF;
+    while (n > 0 && (size_t) r >= iov->iov_len) {
+      r -= iov->iov_len; iov++; n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+    }
   }
-  buf[n++] = (char) ch;
   return 0; /* ok */
 }
 
-int puteol(int style)
-{ /* write eol in given style to stdout */
-  switch (style) {
-    case 'd': putch(CR); /* FALLTHRU */
-    case 'u': return putch(LF);
-    case 'm': return putch(CR);
-    default: abort();
+/* Word-at-a-time search: a word w contains a zero byte iff
+ * (w - 0x0101...01) & ~w & 0x8080...80 is nonzero; xoring w
+ * with a byte repeated through a word turns matches into zeros.
+ */
+#define ONES (~0UL / 255)
+#define HASZERO(w) (((w) - ONES) & ~(w) & (ONES << 7))
+
+const char *findeol(const char *p, const char *end)
+{ /* return pointer to first CR or LF in [p,end), or end if none */
+  unsigned long w;
+
+  while (end - p >= (long) sizeof w) {
+    memcpy(&w, p, sizeof w);
+    if (HASZERO(w ^ (ONES * CR)) || HASZERO(w ^ (ONES * LF))) break;
+    p += sizeof w;
+  }
+  while (p < end && *p != CR && *p != LF) p++;
+  return p;
+}
+
+void convinit(struct conv *cv, int style)
+{ /* prepare for converting a new input */
+  cv->style = style;
+  cv->eol = style == 'd' ? "\r\n" : style == 'm' ? "\r" : "\n";
+  cv->eollen = style == 'd' ? 2 : 1;
+  cv->opts = opts;
+  cv->state = A;
+  cv->bom = (opts & NOBOM) ? 0 : -1;
+  cv->bol = 1; cv->blank = 0;
+  cv->ws = 0; cv->nws = cv->maxws = 0;
+}
+
+int fsm(struct conv *cv, const char *p, const char *end)
+{ /* advance the FSM over the CR or LF at p and return what to do
+     with it: KEEP, DROP, REPLACE, or PAIR to keep a CR LF as is */
+  if (*p == CR) switch (cv->state) {
+    case A:
+    case C: cv->state = C;
+      if (cv->style == 'd' && p+1 < end && p[1] == LF) {
+        cv->state = A; /* as if past the LF */
+        return PAIR;
+      }
+      return cv->style == 'm' ? KEEP : REPLACE;
+    default: cv->state = A; return DROP;
+  }
+  switch (cv->state) { /* LF */
+    case A:
+    case B: cv->state = B; return cv->style == 'u' ? KEEP : REPLACE;
+    default: cv->state = A; return DROP;
+  }
+}
+
+int convbuf(const char *s, size_t n, struct conv *cv, struct sink *sk)
+{ /* convert n bytes at s, carrying the state in *cv;
+     runs of bytes that need no change are written in one go */
+  const char *p = s, *end = s + n;
+  const char *run = s;  /* start of pending verbatim run */
+  int act;
+
+  if (cv->opts) return normbuf(s, n, cv, sk);
+
+  while (p < end) {
+    const char *q = findeol(p, end);
+    if (q > p) cv->state = A;
+    if ((p = q) == end) break;
+    if ((act = fsm(cv, p, end)) == PAIR) {
+      act = KEEP; p++; /* CR LF already in place */
+    }
+    if (act != KEEP) {
+      if (sk->put(sk, run, p - run) == EOF) return EOF;
+      if (act == REPLACE && sk->put(sk, cv->eol, cv->eollen) == EOF)
+        return EOF;
+      run = p + 1;
+    }
+    p++;
+  }
+
+  return sk->put(sk, run, end - run);
+}
+
+/* Like convbuf, but also apply the normalizations in cv->opts.
+ * Blanks at the end of a buffer may turn out to be trailing, so
+ * they are held back in cv->ws until the next buffer tells.
+ */
+#define BOM "\357\273\277"  /* UTF-8 byte order mark */
+#define PUT(s, n) if (sk->put(sk, (s), (n)) == EOF) return EOF
+
+int normbuf(const char *s, size_t n, struct conv *cv, struct sink *sk)
+{
+  const char *p = s, *end = s + n;
+  const char *run = s;  /* start of pending verbatim run */
+  const char *q, *w, *e;
+  int act;
+
+  if (cv->bom >= 0) { /* still at start of input */
+    while (p < end && cv->bom < 3 && *p == BOM[cv->bom]) p++, cv->bom++;
+    if (cv->bom == 3) run = p; /* drop the BOM */
+    else if (p == end) return 0; /* hold back, may be a BOM */
+    else { /* not a BOM: put bytes held from previous buffers */
+      if (p - s < cv->bom) {
+        PUT(BOM, cv->bom - (p - s));
+        cv->bol = 0;
+      }
+      p = s;
+    }
+    cv->bom = -1;
+  }
+
+  while (p < end) {
+    q = findeol(p, end);
+    if (q > p) { /* plain bytes up to q */
+      cv->state = A;
+      w = q; /* start of trailing blanks */
+      if (cv->opts & TRIM)
+        while (w > p && (w[-1] == ' ' || w[-1] == '\t')) w--;
+      if (w > p) { /* line is not blank */
+        cv->bol = 0;
+        if (cv->nws) { /* blanks held back were not trailing */
+          PUT(run, p - run); run = p;
+          PUT(cv->ws, cv->nws); cv->nws = 0;
+        }
+      }
+      if (w < q) { /* drop blanks before EOL, hold back at end */
+        PUT(run, w - run); run = q;
+        if (q == end && hold(cv, w, q - w) == EOF) return EOF;
+      }
+    }
+    if ((p = q) == end) break;
+
+    e = p; /* start of this line end */
+    if ((act = fsm(cv, p, end)) == PAIR) {
+      act = KEEP; p++; /* CR LF already in place */
+    }
+    if (act != DROP) { /* end of a line */
+      cv->nws = 0; /* held back blanks were trailing */
+      if ((cv->opts & SQUEEZE) && cv->bol && cv->blank) act = DROP;
+      cv->blank = cv->bol;
+      cv->bol = 1;
+    }
+    if (act != KEEP) {
+      PUT(run, e - run);
+      if (act == REPLACE) PUT(cv->eol, cv->eollen);
+      run = p + 1;
+    }
+    p++;
+  }
+
+  PUT(run, end - run);
+  return 0; /* ok */
+}
+
+int hold(struct conv *cv, const char *s, size_t n)
+{ /* append n bytes at s to the held back blanks */
+  char *ws;
+
+  if (cv->nws + n > cv->maxws) {
+    cv->maxws = 2 * (cv->nws + n);
+    if (!(ws = realloc(cv->ws, cv->maxws))) return EOF;
+    cv->ws = ws;
+  }
+  memcpy(cv->ws + cv->nws, s, n);
+  cv->nws += n;
+  return 0; /* ok */
+}
+
+int convend(struct conv *cv, struct sink *sk)
+{ /* finish conversion at end of input */
+  free(cv->ws);
+  cv->ws = 0; cv->nws = 0; /* blanks at end are trailing */
+  if (cv->bom > 0) { /* a short file starting like a BOM */
+    PUT(BOM, cv->bom);
+    cv->bol = 0;
+  }
+  cv->bom = -1;
+  if ((cv->opts & FINAL) && !cv->bol) {
+    PUT(cv->eol, cv->eollen);
+    cv->bol = 1;
+  }
+  return 0; /* ok */
+}
+
+size_t chunkstart(const char *p, size_t size, size_t i)
+{ /* return start of chunk i: the first byte at or after i*CHUNKSIZE
+     that is preceded by a byte other than CR and LF */
+  size_t x = i * CHUNKSIZE;
+
+  if (x == 0) return 0;
+  if (x >= size) return size;
+  while (x < size && (p[x-1] == CR || p[x-1] == LF)) x++;
+  return x;
+}
+
+void *worker(void *arg)
+{ /* count or convert chunks until there are none left */
+  struct job *jp = arg;
+  char buf[IOSIZE];
+  struct sink sk;
+  struct conv cv;
+  size_t i, lo, hi;
+
+  sk.put = jp->pass == 1 ? putcnt : putbuf; sk.fd = 1;
+  sk.buf = buf; sk.size = sizeof buf;
+  sk.iov = 0; sk.niov = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&jp->lock);
+    i = jp->errnum ? jp->nchunks : jp->next++;
+    pthread_mutex_unlock(&jp->lock);
+    if (i >= jp->nchunks) break;
+
+    lo = chunkstart(jp->p, jp->size, i);
+    hi = chunkstart(jp->p, jp->size, i+1);
+    sk.len = 0; sk.off = jp->offs[i];
+    convinit(&cv, jp->style);
+    if (convbuf(jp->p + lo, hi - lo, &cv, &sk) == EOF ||
+        flushsink(&sk) == EOF) {
+      pthread_mutex_lock(&jp->lock);
+      if (!jp->errnum) jp->errnum = errno ? errno : EIO;
+      pthread_mutex_unlock(&jp->lock);
+      break;
+    }
+    if (jp->pass == 1) jp->offs[i] = sk.off; /* output size */
+  }
+  return 0;
+}
+
+int convpar(const char *p, size_t size, int style)
+{ /* convert mapped input on njobs threads, pwrite to stdout */
+  pthread_t tid[MAXJOBS];
+  struct job job;
+  off_t n, off;
+  unsigned t;
+  size_t i;
+
+  if ((off = lseek(1, 0, SEEK_CUR)) < 0) return EOF;
+
+  job.p = p; job.size = size; job.style = style;
+  job.nchunks = (size + CHUNKSIZE - 1) / CHUNKSIZE;
+  job.errnum = 0;
+  if (!(job.offs = malloc(job.nchunks * sizeof *job.offs))) return EOF;
+  for (i = 0; i < job.nchunks; i++) job.offs[i] = 0;
+  pthread_mutex_init(&job.lock, 0);
+
+  for (job.pass = 1; job.pass <= 2 && !job.errnum; job.pass++) {
+    job.next = 0;
+    for (t = 0; t < njobs; t++)
+      if ((errno = pthread_create(&tid[t], 0, worker, &job))) break;
+    if (t == 0) job.errnum = errno;
+    while (t > 0) pthread_join(tid[--t], 0);
+
+    if (job.pass == 1) /* output sizes to offsets */
+      for (i = 0; i < job.nchunks; i++) {
+        n = job.offs[i]; job.offs[i] = off; off += n;
+      }
+  }
+
+  pthread_mutex_destroy(&job.lock);
+  free(job.offs);
+  if (job.errnum) { errno = job.errnum; return EOF; }
+  return lseek(1, off, SEEK_SET) < 0 ? EOF : 0;
+}
+
+int convmap(int fd, off_t off, size_t size, int style)
+{ /* convert size bytes of a regular file from offset off on
+     by mapping them into memory; return 1 if they cannot be mapped */
+  static struct iovec iov[NIOV];
+  struct conv cv;
+  struct sink sk;
+  struct stat st;
+  long pagesize;
+  size_t skip;
+  int erc;
+  char *m, *p;
+
+  /* mmap(2) wants the offset at a page boundary */
+  if ((pagesize = sysconf(_SC_PAGESIZE)) <= 0) pagesize = 4096;
+  skip = off % pagesize;
+  if (size > (size_t) -1 - skip) return 1;
+  m = mmap(0, skip + size, PROT_READ, MAP_PRIVATE, fd, off - skip);
+  if (m == MAP_FAILED) return 1;
+  p = m + skip;
+
+  /* Large input, output to a regular file: go parallel
+     (unless normalizing, which needs the previous lines) */
+  if (njobs > 1 && size > CHUNKSIZE && !opts && fstat(1, &st) == 0 &&
+      S_ISREG(st.st_mode) && !(fcntl(1, F_GETFL) & O_APPEND)) {
+    erc = convpar(p, size, style);
+    (void) munmap(m, skip + size);
+    return erc;
   }
+
+  sk.put = ispipe(1) ? putspl : putiov; sk.fd = 1; sk.off = -1;
+  sk.buf = 0; sk.len = sk.size = 0;
+  sk.iov = iov; sk.niov = 0;
+  sk.ifd = fd; sk.map = p; sk.mapsize = size; sk.mapoff = off;
+
+  convinit(&cv, style);
+  erc = convbuf(p, size, &cv, &sk);
+  if (erc != EOF) erc = convend(&cv, &sk);
+  if (erc != EOF) erc = flushsink(&sk);
+  free(cv.ws); /* convend did not if convbuf failed */
+  (void) munmap(m, skip + size);
+  return erc;
 }
 
 int convert(int fd, int style)
 {
-  int c, erc = 0;
-  enum { A, B, C } state = A;
+  static char ibuf[IOSIZE], obuf[IOSIZE];
+  struct conv cv;
+  struct sink sk;
+  struct stat st;
+  off_t off;
+  int erc;
+  ssize_t n;
+
+  /* Regular files: map input from the current offset on (some
+     may have been read already), point output into the mapping,
+     and leave the offset at the end, as if we had read it all */
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (off = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > off &&
+      (off_t) (size_t) st.st_size == st.st_size &&
+      (erc = convmap(fd, off, st.st_size - off, style)) != 1) {
+    if (erc != EOF && lseek(fd, 0, SEEK_END) < 0) return EOF;
+    return erc;
+  }
+
+  /* Pipes and the like: read and write through buffers */
+  sk.put = putbuf; sk.fd = 1; sk.off = -1;
+  sk.buf = obuf; sk.len = 0; sk.size = sizeof obuf;
+  sk.iov = 0; sk.niov = 0;
+
+  convinit(&cv, style);
+  erc = EOF;
+  while ((n = read(fd, ibuf, sizeof ibuf)) > 0)
+    if (convbuf(ibuf, n, &cv, &sk) == EOF) goto done;
+  if (n < 0 || convend(&cv, &sk) == EOF) goto done;
+  erc = flushsink(&sk); /* flush and done */
+
+done:
+  free(cv.ws);
+  return erc;
+}
+
+char *tmpname(const char *fn)
+{ /* malloc a mkstemp(3) template in the directory of fn */
+  const char *slash = strrchr(fn, '/');
+  size_t n = slash ? (size_t) (slash - fn) + 1 : 0;
+  char *s;
+
+  if ((s = malloc(n + sizeof ".eolXXXXXX"))) {
+    memcpy(s, fn, n);
+    strcpy(s + n, ".eolXXXXXX");
+  }
+  return s;
+}
+
+int rewrite(const char *fn, int style)
+{ /* convert file fn in place through a temporary file and rename(2);
+     leave it alone if it looks binary or is already in target style */
+  struct iovec iov[NIOV];
+  struct conv cv;
+  struct sink sk;
+  struct stat st;
+  char *tmp = 0;
+  int e, fd, tfd = -1, erc = EOF, same;
+  size_t size = 0;
+  void *p = MAP_FAILED;
+
+  if ((fd = open(fn, O_RDONLY)) < 0) return EOF;
+  if (fstat(fd, &st) < 0) goto done;
+  size = st.st_size;
+  if ((off_t) size != st.st_size) { errno = EFBIG; goto done; }
+  if (size == 0) { erc = 0; goto done; } /* nothing to do */
+
+  p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) goto done;
+  if (memchr(p, 0, size < BINCHECK ? size : BINCHECK)) {
+    erc = 0; goto done; /* binary file */
+  }
+
+  sk.put = putchk; sk.next = p;
+  convinit(&cv, style);
+  same = convbuf(p, size, &cv, &sk) != EOF &&
+         convend(&cv, &sk) != EOF && sk.next == (char *) p + size;
+  free(cv.ws);
+  if (same) { erc = 0; goto done; } /* already in target style */
+
+  if (!(tmp = tmpname(fn)) || (tfd = mkstemp(tmp)) < 0) goto done;
+  (void) fchmod(tfd, st.st_mode & 07777);
+
+  sk.put = putiov; sk.fd = tfd; sk.off = -1;
+  sk.buf = 0; sk.len = sk.size = 0;
+  sk.iov = iov; sk.niov = 0;
+
+  convinit(&cv, style);
+  e = convbuf(p, size, &cv, &sk);
+  if (e != EOF) e = convend(&cv, &sk);
+  free(cv.ws);
+  if (e == EOF || flushsink(&sk) == EOF) goto done;
+  e = close(tfd); tfd = -1;
+  if (e < 0 || rename(tmp, fn) < 0) goto done;
+  free(tmp); tmp = 0;
+  erc = 0; /* ok */
+
+done:
+  e = errno;
+  if (tfd >= 0) (void) close(tfd);
+  if (tmp) { (void) unlink(tmp); free(tmp); }
+  if (p != MAP_FAILED) (void) munmap(p, size);
+  (void) close(fd);
+  errno = e;
+  return erc;
+}
+
+void *fileworker(void *arg)
+{ /* rewrite (or count) files from the work list until none are left */
+  int erc, style = *(int *) arg;
+  size_t i;
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    i = nextpath++;
+    pthread_mutex_unlock(&lock);
+    if (i >= npaths) break;
+
+    if (counts) erc = countfile(paths[i], &counts[i]);
+    else erc = rewrite(paths[i], style);
+    if (erc == EOF) {
+      fprintf(stderr, "%s: cannot %s %s: %s\n", me,
+              counts ? "read" : "convert", paths[i], strerror(errno));
+      if (counts) counts[i].binary = -1; /* not counted */
+      pthread_mutex_lock(&lock);
+      nfail += 1;
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  return 0;
+}
+
+int addpath(const char *path)
+{ /* append a copy of path to the work list */
+  char **pp;
+
+  if (npaths == maxpaths) {
+    maxpaths = maxpaths ? 2 * maxpaths : 256;
+    if (!(pp = realloc(paths, maxpaths * sizeof *paths))) return EOF;
+    paths = pp;
+  }
+  if (!(paths[npaths] = malloc(strlen(path) + 1))) return EOF;
+  strcpy(paths[npaths++], path);
+  return 0; /* ok */
+}
+
+void collect(const char *path, int recurse, int depth)
+{ /* add regular files at path to the work list; if recurse, descend
+     into directories, skipping names that start with a dot */
+  struct dirent *de;
+  struct stat st;
+  char *sub;
+  DIR *dp;
+  int e;
+
+  if (lstat(path, &st) < 0) goto fail;
+  if (S_ISREG(st.st_mode)) {
+    if (addpath(path) == EOF) goto fail;
+    return;
+  }
+  if (!S_ISDIR(st.st_mode) || !recurse) {
+    if (depth > 0) return; /* skip links and special files */
+    fprintf(stderr, "%s: cannot convert %s: %s\n", me, path,
+            S_ISDIR(st.st_mode) ? "is a directory" : "not a regular file");
+    nfail += 1;
+    return;
+  }
+
+  if (!(dp = opendir(path))) goto fail;
+  while ((de = readdir(dp))) {
+    if (de->d_name[0] == '.') continue;
+    if (!(sub = malloc(strlen(path) + strlen(de->d_name) + 2))) break;
+    sprintf(sub, "%s/%s", path, de->d_name);
+    collect(sub, recurse, depth + 1);
+    free(sub);
+  }
+  if (de) { /* out of memory */
+    e = errno; (void) closedir(dp); errno = e;
+    goto fail;
+  }
+  if (closedir(dp) < 0) goto fail;
+  return;
+
+fail:
+  fprintf(stderr, "%s: cannot open %s: %s\n", me, path, strerror(errno));
+  nfail += 1;
+}
+
+int convfiles(int style)
+{ /* rewrite (or count) all files on the work list on njobs threads */
+  pthread_t tid[MAXJOBS];
+  unsigned t;
+
+  for (t = 0; t < njobs; t++)
+    if (pthread_create(&tid[t], 0, fileworker, &style)) break;
+  if (t == 0) fileworker(&style);
+  while (t > 0) pthread_join(tid[--t], 0);
+  return nfail ? EOF : 0;
+}
+
+void tally(const char *s, size_t n, struct census *cp)
+{ /* count the line ends in n bytes at s, following the states
+     of fsm(): a CR after a LF, or a LF after a CR, pairs up with it */
+  const char *p = s, *end = s + n;
+
+  while (p < end) {
+    const char *q = findeol(p, end);
+    if (q > p) cp->state = A;
+    if ((p = q) == end) break;
+    if (*p == CR) {
+      if (cp->state == B) { /* LF CR */
+        cp->lf -= 1; cp->lfcr += 1; cp->state = A;
+      }
+      else { cp->cr += 1; cp->state = C; }
+    }
+    else if (cp->state == C) { /* CR LF */
+      cp->cr -= 1; cp->crlf += 1; cp->state = A;
+    }
+    else { cp->lf += 1; cp->state = B; }
+    p++;
+  }
+}
+
+int census(int fd, struct census *cp)
+{ /* count line ends in the file open on fd, from its offset on */
+  char ibuf[IOSIZE]; /* on the stack: worker threads call us */
+  struct stat st;
+  size_t size, skip, seen = 0;
+  long pagesize;
+  off_t off;
+  ssize_t n;
+  char *m;
+
+  cp->lf = cp->crlf = cp->cr = cp->lfcr = 0;
+  cp->state = A; cp->binary = 0;
 
-  errno = 0;
-  (void) getch(-1);  /* prepare input buffer */
-  while (1) {
-    switch (c = getch(fd)) {
-      case CR: switch (state) {
-        case A: state = C;  /* FALLTHRU */
-        case C: erc = puteol(style); break;
-        case B: state = A; break; } break;
-      case LF: switch (state) {
-        case A: state = B;  /* FALLTHRU */
-        case B: erc = puteol(style); break;
-        case C: state = A; break; } break;
-      case EOF: if (errno) return EOF;
-        return putch(EOF); /* flush and done */
-      default: state = A; erc = putch(c); break;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (off = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > off &&
+      (off_t) (size_t) st.st_size == st.st_size) {
+    if ((pagesize = sysconf(_SC_PAGESIZE)) <= 0) pagesize = 4096;
+    skip = off % pagesize; /* map from a page boundary */
+    size = st.st_size - off;
+    m = mmap(0, skip + size, PROT_READ, MAP_PRIVATE, fd, off - skip);
+    if (m != MAP_FAILED) {
+      if (memchr(m + skip, 0, size < BINCHECK ? size : BINCHECK)) cp->binary = 1;
+      else tally(m + skip, size, cp);
+      (void) munmap(m, skip + size);
+      return lseek(fd, 0, SEEK_END) < 0 ? EOF : 0;
     }
-    if (erc == EOF) return EOF;
   }
+
+  /* Cannot map: read through buffer */
+  while ((n = read(fd, ibuf, sizeof ibuf)) > 0) {
+    if (seen < BINCHECK && memchr(ibuf, 0, n < BINCHECK ? n : BINCHECK)) {
+      cp->lf = cp->crlf = cp->cr = cp->lfcr = 0;
+      cp->binary = 1;
+      break;
+    }
+    seen += n;
+    tally(ibuf, n, cp);
+  }
+  return n < 0 ? EOF : 0;
+}
+
+int countfile(const char *fn, struct census *cp)
+{ /* count line ends in file fn */
+  int fd, erc;
+
+  if ((fd = open(fn, O_RDONLY)) < 0) return EOF;
+  erc = census(fd, cp);
+  (void) close(fd);
+  return erc;
+}
+
+const char *stylename(const struct census *cp)
+{ /* name the line end style found */
+  if (cp->binary) return "binary";
+  if (!!cp->lf + !!cp->crlf + !!cp->cr + !!cp->lfcr > 1) return "mixed";
+  return cp->lf ? "unix" : cp->crlf ? "dos" : cp->cr ? "mac" :
+         cp->lfcr ? "lfcr" : "none";
+}
+
+int needsconv(const struct census *cp, int style)
+{ /* return true iff converting to style would change something */
+  if (cp->binary) return 0;
+  switch (style) {
+    case 'd': return cp->lf || cp->cr || cp->lfcr;
+    case 'm': return cp->lf || cp->crlf || cp->lfcr;
+    default: return cp->crlf || cp->cr || cp->lfcr;
+  }
+}
+
+int report(const struct census *cp, const char *name)
+{
+  return printf("%lu\t%lu\t%lu\t%lu\t%s\t%s\n",
+                cp->lf, cp->crlf, cp->cr, cp->lfcr, stylename(cp), name);
+}
+
+int usage(void)
+{
+  fprintf(stderr, "Usage: %s [-umd] [-bcnt] [-j n] [files]\n", me);
+  fprintf(stderr, "   or: %s -i [-r] [-umd] [-bcnt] [-j n] files\n", me);
+  fprintf(stderr, "   or: %s -s [-r] [-umd] [-j n] [files]\n", me);
+  fputs(" Convert to Unix (u, default), Mac (m), or DOS (d) style\n", stderr);
+  fputs(" end-of-lines. Read from stdin (or files). Write to stdout.\n", stderr);
+  fputs(" Also remove a UTF-8 BOM (b), collapse repeated blank lines (c),\n", stderr);
+  fputs(" end the last line (n), remove blanks at end of lines (t).\n", stderr);
+  fputs(" With -j, convert large files on n threads if stdout is a file.\n", stderr);
+  fputs(" With -i, convert files in place (n at a time with -j).\n", stderr);
+  fputs(" With -s, only count line ends: LF, CR LF, CR, LF CR, style, file;\n", stderr);
+  fputs(" exit 1 if any file is not in the given style.\n", stderr);
+  fputs(" With -r, also all files below directories, except those\n", stderr);
+  fputs(" whose names start with a dot, and symbolic links.\n", stderr);
+  return FAILHARD;
 }
 
 int main(int argc, char *argv[])
 {
-  const char *me;
-  int style;
+  int n, inplace = 0, stats = 0, recurse = 0;
+  int style = 'u'; /* default style is Unix */
 
   if (argv && *argv) me = *argv++;
   else return 127; /* no arg0? */
 
-  if (*argv && ((*argv)[0] == '-') && (*argv)[1]) {
-    if ((*argv)[2]) style = '!';
-    else style = (*argv)[1];
-    argv++; argc--; /* shift */
-  } else style = 'u'; /* default style is Unix */
+  while (*argv && ((*argv)[0] == '-') && (*argv)[1]) {
+    const char *opt = *argv++;
+    argc--; /* shift */
+    while (*++opt) switch (*opt) {
+      case 'u': case 'm': case 'd': style = *opt; break;
+      case 'i': inplace = 1; break;
+      case 'r': recurse = 1; break;
+      case 's': stats = 1; break;
+      case 'b': opts |= NOBOM; break;
+      case 'c': opts |= SQUEEZE; break;
+      case 'n': opts |= FINAL; break;
+      case 't': opts |= TRIM; break;
+      case 'j': if (*argv && (n = scanuint(*argv, &njobs)) && !(*argv)[n]) {
+                  argv++; argc--; /* shift */
+                  if (njobs > MAXJOBS) njobs = MAXJOBS;
+                  break;
+                } /* FALLTHRU */
+      default: return usage();
+    }
+  }
+
+  if ((recurse && !inplace && !stats) || (inplace && stats) ||
+      (stats && opts)) return usage();
+  if (stats) {
+    struct census total, one;
+    size_t i;
+    int dirty = 0;
+
+    if (!*argv) { /* count stdin */
+      if (census(0, &one) == EOF) {
+        fprintf(stderr, "%s: cannot read stdin: %s\n", me, strerror(errno));
+        return FAILSOFT;
+      }
+      report(&one, "-");
+      return needsconv(&one, style) ? 1 : SUCCESS;
+    }
 
-  if ((style != 'u' && style != 'm' && style != 'd') || style == '?') {
-    fprintf(stderr, "Usage: %s [-umd] [files]\n", me);
-    fputs(" Convert to Unix (u, default), Mac (m), or DOS (d) style\n", stderr);
-    fputs(" end-of-lines. Read from stdin (or files). Write to stdout.\n", stderr);
-    return FAILHARD;
+    while (*argv) collect(*argv++, recurse, 0);
+    if (npaths && !(counts = malloc(npaths * sizeof *counts))) {
+      fprintf(stderr, "%s: %s\n", me, strerror(errno));
+      return FAILSOFT;
+    }
+    convfiles(style);
+
+    total.lf = total.crlf = total.cr = total.lfcr = 0;
+    total.binary = 0;
+    for (i = 0; i < npaths; i++) {
+      if (counts[i].binary < 0) continue; /* failed */
+      report(&counts[i], paths[i]);
+      total.lf += counts[i].lf;
+      total.crlf += counts[i].crlf;
+      total.cr += counts[i].cr;
+      total.lfcr += counts[i].lfcr;
+      dirty |= needsconv(&counts[i], style);
+    }
+    report(&total, "total");
+    if (fflush(stdout) == EOF || nfail) return FAILSOFT;
+    return dirty ? 1 : SUCCESS;
+  }
+  if (inplace) {
+    if (!*argv) return usage();
+    while (*argv) collect(*argv++, recurse, 0);
+    return convfiles(style) == EOF ? FAILSOFT : SUCCESS;
   }
 
   if (*argv) while (*argv) {
@@ -1,5 +1,12 @@
 /* Show IPv4 address information.
  * Usage: ipinfo [-hV] address[/n] [mask]
+ *    or: ipinfo -b < file
+ *    or: ipinfo -l prefixes < file
+ *    or: ipinfo -C prefixes table
+ *    or: ipinfo -a [-e] [file ...]
+ *    or: ipinfo -i|-d [-e] file ...
+ *    or: ipinfo -e [-H] [-k i/n] network|range ...
+ *    or: ipinfo -f [-r] [-n bits] < log
  * History:
  *   ujr/2001-10-25 started
  *   ujr/2002-09-03 added command line switches for selective output
@@ -9,12 +16,72 @@
  * License: GNU General Public License (GPL).
  */
 
+#define _POSIX_C_SOURCE 200809L  /* for mmap */
+
+#include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
 
+#define IOSIZE 65536  /* input buffer size */
+#define OBUFSIZE (1L<<20)  /* output buffer size */
+#define MAXLINE 256   /* input lines are cut to this length */
+#define MAXREC 128    /* longest output record for a valid line */
+#define MAXRUN 32     /* longest digits-and-dots run carried over (-f) */
+#define MAXANN 1024   /* annotations appended to one line (-f) */
+
+/* Longest prefix match (-l): a DIR-24-8 table. tbl24 has one entry
+   per /24: 0 if no prefix covers it, route+1 for the longest prefix
+   that does, or BLOCK|b if prefixes longer than /24 start in it;
+   then entry ip&255 of block b (256 entries in tbl8) tells. A table
+   file (-C) holds header, tbl24, tbl8, routes and a pool of labels,
+   all native uint32, and is mapped as is. */
+#define LPMMAGIC "IPLPM\n\0\0"
+#define ORDERMARK 0x01020304
+#define BLOCK 0x80000000
+#define NTBL24 (1L << 24)
+
+struct lpmhdr {
+  char magic[8];           /* LPMMAGIC */
+  uint32 order;            /* ORDERMARK, to detect foreign byte order */
+  uint32 nblocks, nroutes, poolsize;
+};
+
+struct route {
+  uint32 net, bits;        /* the prefix */
+  uint32 label;            /* offset of label in pool */
+};
+
+struct lpm {
+  const uint32 *tbl24, *tbl8;
+  const struct route *routes;
+  const char *pool;
+  uint32 nblocks, nroutes, poolsize;
+};
+
+/* Lists of address ranges (-a, -i, -d): read, radix sorted by low
+   end, merged where they overlap or touch, combined as sets by
+   walking two such lists side by side, and written as CIDRs; memory
+   is 8 bytes per range, however many addresses it has */
+struct range {
+  uint32 lo, hi;           /* inclusive */
+};
+
+struct rlist {
+  struct range *r;
+  size_t n, max;
+  long lineno;
+  const char *name;        /* file name for messages, or null */
+  int err;                 /* out of memory */
+};
+
 static char id[] = "This is ipinfo, version 1.0\n"
                    "Copyright (c) 2001-2007 by UJR\n";
 
@@ -30,8 +97,56 @@ static int scanip4(const char *s, uint32 *ip);
 static const char *fmtip2(uint32 ip, int slash);
 static const char *fmtsep(int slash);
 
+static int eachline(FILE *fp, int (*fn)(const char *s, const char *end));
+static int putinfo(const char *s, const char *end);
+static int putbad(const char *s, const char *end);
+static int parseip4(const char *s, const char *end, uint32 *ip);
+static void initoctets(void);
+static char *putip(char *p, uint32 ip);
+static char *room(size_t n);
+static void flushout(void);
+
+static int loadlpm(const char *fn);
+static int buildlpm(FILE *fp, const char *fn);
+static int addroute(const char *s, const char *end);
+static int savelpm(const char *fn);
+static uint32 lookup(uint32 ip);
+static int putmatch(const char *s, const char *end);
+static int logup(int code, const char *fmt, ...);
+
+static int parserange(const char *s, const char *end, uint32 *lo, uint32 *hi);
+static int setmain(int op, char **files, int eflag);
+static int setop(int op, const struct rlist *a, const struct rlist *b, struct rlist *c);
+static int readlist(const char *fn, struct rlist *lp);
+static int addrange(const char *s, const char *end);
+static int sortranges(struct rlist *lp);
+static void mergeranges(struct rlist *lp);
+static void putcidrs(uint32 lo, uint32 hi);
+static void putaddrs(uint32 lo, uint32 hi);
+static int enumerate(char **args, int hflag, unsigned shard, unsigned nshards);
+static int filter(int rflag, int bits);
+static char *putann(char *p, uint32 ip, int bits, int sep);
+static void putraw(const char *s, size_t n);
+static char *putnet(char *p, uint32 net, int bits);
+
 static char *me = "ipinfo";
 
+static char octets[256][4]; /* decimal digits, count in [3] */
+static char obuf[OBUFSIZE]; /* output buffer (batch modes) */
+static size_t olen;         /* bytes in obuf */
+static int oerr;            /* true after a write error */
+
+static struct lpm lpm;      /* prefix table (-l, -C) */
+static struct {             /* while building it */
+  struct route *routes;
+  size_t nroutes, maxroutes;
+  char *pool;
+  size_t npool, maxpool, last;
+  long lineno;
+  int bad;
+} bld;
+static struct rlist *rcur;  /* list that addrange() appends to */
+
 int main(int argc, char *argv[])
 {
   const char *addrstr;
@@ -40,6 +155,10 @@ int main(int argc, char *argv[])
   int c, i, j, slash = -1; /* no slash */
   char ipclass = 0; /* classless */
   uint32 nwaddr, bcaddr, count;
+  int bflag = 0, cflag = 0, eflag = 0, hflag = 0, op = 0;
+  int fflag = 0, rflag = 0, bits = -1;
+  unsigned shard = 1, nshards = 1;
+  const char *lfn = 0;
 
   (void) argc; /* unused */
   if (argv && *argv) me = *argv;
@@ -47,14 +166,79 @@ int main(int argc, char *argv[])
 
   while (*++argv && (**argv == '-')) {
     while ((c = *++argv[0])) switch (c) {
+      case 'a': case 'i': case 'd': op = c; break;
+      case 'b': bflag = 1; break;
+      case 'C': cflag = 1; break;
+      case 'e': eflag = 1; break;
+      case 'H': hflag = 1; break;
+      case 'f': fflag = 1; break;
+      case 'r': rflag = 1; break;
+      case 'n':
+        if (argv[0][1] || !argv[1]) return usage("option -n needs a bit count");
+        i = scanuint(*++argv, (unsigned *) &bits);
+        if (!i || argv[0][i] || bits < 0 || bits > 32)
+          return usage("invalid bit count, need 0..32");
+        goto nextarg;
+      case 'k':
+        if (argv[0][1] || !argv[1]) return usage("option -k needs i/n");
+        i = scanuint(*++argv, &shard);
+        if (!i || argv[0][i] != '/' || !(j = scanuint(argv[0]+i+1, &nshards)) ||
+            argv[0][i+1+j] || shard < 1 || shard > nshards)
+          return usage("invalid shard, need i/n with 1 <= i <= n");
+        goto nextarg;
+      case 'l':
+        if (argv[0][1] || !argv[1]) return usage("option -l needs a file");
+        lfn = *++argv;
+        goto nextarg;
       case 'h': return usage(0);
       case 'V': return identity();
       case '-': argv++; goto endargs;
       default: return usage("invalid option");
     }
+nextarg: ;
   }
 endargs:
 
+  initoctets();
+
+  if (bflag) { /* one address per line from stdin */
+    if (*argv) return usage("too many arguments");
+    i = eachline(stdin, putinfo);
+    flushout();
+    if (oerr || fflush(stdout) == EOF) return FAILSOFT;
+    return i ? FAILSOFT : SUCCESS;
+  }
+
+  if (op) { /* set operations on address lists */
+    if (op != 'a' && !*argv) return usage("need a file");
+    return setmain(op, argv, eflag);
+  }
+
+  if (fflag) { /* annotate addresses in text */
+    if (*argv) return usage("too many arguments");
+    return filter(rflag, bits);
+  }
+
+  if (eflag) { /* enumerate addresses */
+    if (!*argv) return usage("need a network or range");
+    return enumerate(argv, hflag, shard, nshards);
+  }
+
+  if (cflag) { /* compile prefix file into table file */
+    if (!argv[0] || !argv[1] || argv[2]) return usage("need prefix file and table file");
+    if ((i = loadlpm(argv[0])) != SUCCESS) return i;
+    return savelpm(argv[1]);
+  }
+
+  if (lfn) { /* longest prefix match for addresses from stdin */
+    if (*argv) return usage("too many arguments");
+    if ((i = loadlpm(lfn)) != SUCCESS) return i;
+    i = eachline(stdin, putmatch);
+    flushout();
+    if (oerr || fflush(stdout) == EOF) return FAILSOFT;
+    return i ? FAILSOFT : SUCCESS;
+  }
+
   if (*argv) addrstr = *argv++;
   else return usage("no address specified");
 
@@ -115,7 +299,7 @@ endargs:
   bcaddr = addr | mask;
   mask = ~mask; /* convert to netmask */
   nwaddr = addr & mask;
-  count = (1 << (32 - slash)) - 2;
+  count = slash ? ((uint32) 1 << (32 - slash)) - 2 : (uint32) -2; /* no shift by 32 */
 
   if (ipclass) printf("Class %c", ipclass);
   else printf("CIDR %d", slash);
@@ -146,6 +330,13 @@ static int usage(const char *errmsg)
   else fprintf(fp, "Show IPv4 address information\n");
   fprintf(fp, "Usage: %s [-V] address/n\n", me);
   fprintf(fp, "   or: %s [-V] address [mask]\n", me);
+  fprintf(fp, "   or: %s -b < file\n", me);
+  fprintf(fp, "   or: %s -l prefixes < file\n", me);
+  fprintf(fp, "   or: %s -C prefixes table\n", me);
+  fprintf(fp, "   or: %s -a [-e] [file ...]\n", me);
+  fprintf(fp, "   or: %s -i|-d [-e] file ...\n", me);
+  fprintf(fp, "   or: %s -e [-H] [-k i/n] network|range ...\n", me);
+  fprintf(fp, "   or: %s -f [-r] [-n bits] < log\n", me);
   return errmsg ? FAILHARD : SUCCESS;
 }
 
@@ -230,8 +421,7 @@ static const char *fmtip2(uint32 ip, int slash)
   int i, j;
   static char buf[80];
 
-  i = sprintf(buf, "%d.%d.%d.%d", /* dotted decimal */
-    (int) (ip>>24)&255, (int) (ip>>16)&255, (int) (ip>>8)&255, (int) ip&255);
+  i = putip(buf, ip) - buf; /* dotted decimal */
   for (; i < 17; i++) buf[i] = ' ';
   slash = 32 - slash;
   for (j=31; j>=0; j--) { /* binary representation */
@@ -258,3 +448,835 @@ static const char *fmtsep(int slash)
 
   return (const char *) buf;
 }
+
+/** Call fn on each line from fp (without the newline, cut to
+ * MAXLINE chars); return the number of calls that returned nonzero.
+ */
+static int eachline(FILE *fp, int (*fn)(const char *s, const char *end))
+{
+  static char ibuf[IOSIZE+MAXLINE];
+  char *p, *end, *nl;
+  size_t n, left = 0;
+  int skip = 0, bad = 0;
+
+  for (;;) {
+    n = fread(ibuf+left, 1, IOSIZE, fp);
+    end = ibuf + left + n;
+    if (n == 0) { /* last line may lack the newline */
+      if (left && !skip) bad += fn(ibuf, end) != 0;
+      break;
+    }
+    for (p = ibuf; (nl = memchr(p, '\n', end-p)); p = nl+1) {
+      if (skip) skip = 0; /* end of a long line */
+      else bad += fn(p, nl - p > MAXLINE ? p+MAXLINE : nl) != 0;
+    }
+    left = end - p;
+    if (left > MAXLINE) { /* cut a long line */
+      if (!skip) bad += fn(p, p+MAXLINE) != 0;
+      skip = 1; left = 0;
+    }
+    else memmove(ibuf, p, left);
+  }
+
+  return bad;
+}
+
+/** Write one record for the address (and optional /n or mask) in
+ * the line from s to end: address, net bits, class (or -), kind,
+ * private or public, network and broadcast address, tab separated.
+ * Computed as in main(); return 0, or 1 if the line is invalid.
+ */
+static int putinfo(const char *s, const char *end)
+{
+  static const char *kinds[] = { "network", "broadcast", "host" };
+  static const char *privs[] = { "public", "private" };
+  uint32 addr, mask, nwaddr, bcaddr;
+  unsigned slash = 0;
+  int i, j, bits;
+  char ipclass = 0, *q;
+  const char *kind, *priv;
+
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+  if (s == end) return 0; /* skip blank lines */
+
+  if ((i = parseip4(s, end, &addr)) == 0) return putbad(s, end);
+  if (s+i < end && s[i] == '/') { /* slash value */
+    for (j = ++i; s+i < end && s[i] >= '0' && s[i] <= '9' && i-j < 3; i++)
+      slash = 10*slash + (s[i]-'0');
+    if (i == j || slash > 32 || s+i != end) return putbad(s, end);
+    mask = slash ? ((uint32) 1 << (32-slash)) - 1 : 0xffffffff;
+  }
+  else if (s+i < end && (s[i] == ' ' || s[i] == '\t')) { /* mask */
+    while (s[i] == ' ' || s[i] == '\t') i++;
+    if ((j = parseip4(s+i, end, &mask)) == 0 || s+i+j != end)
+      return putbad(s, end);
+    if (mask & 0x80000000) mask = ~mask;
+    if ((bits = mask2bits(mask)) < 0) return putbad(s, end);
+    slash = 32 - bits;
+  }
+  else if (s+i == end) { /* class */
+    ipclass = getclass(addr);
+    mask = getmask(ipclass);
+    slash = 32 - mask2bits(mask);
+  }
+  else return putbad(s, end);
+
+  bcaddr = addr | mask;
+  nwaddr = addr & ~mask;
+  kind = kinds[nwaddr == addr ? 0 : bcaddr == addr ? 1 : 2];
+  priv = privs[ispriv(addr)];
+
+  q = room(MAXREC);
+  q = putip(q, addr); *q++ = '\t';
+  if (slash >= 10) *q++ = '0' + slash/10;
+  *q++ = '0' + slash%10; *q++ = '\t';
+  *q++ = ipclass ? ipclass : '-'; *q++ = '\t';
+  while (*kind) *q++ = *kind++;
+  *q++ = '\t';
+  while (*priv) *q++ = *priv++;
+  *q++ = '\t';
+  q = putip(q, nwaddr); *q++ = '\t';
+  q = putip(q, bcaddr); *q++ = '\n';
+  olen = q - obuf;
+
+  return 0;
+}
+
+/** Write a record for an invalid line: the line, tab, "invalid" */
+static int putbad(const char *s, const char *end)
+{
+  char *q = room(MAXLINE+10);
+
+  if (end - s > MAXLINE) end = s + MAXLINE;
+  memcpy(q, s, end-s); q += end-s;
+  memcpy(q, "\tinvalid\n", 9); q += 9;
+  olen = q - obuf;
+
+  return 1;
+}
+
+/** Like scanip4(), but on the bytes from s to end, without scanuint()
+ * and its calls to isdigit(); return #chars scanned or 0 */
+static int parseip4(const char *s, const char *end, uint32 *ip)
+{
+  const char *p = s;
+  uint32 value = 0;
+  unsigned octet, d;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (i > 0 && (p == end || *p++ != '.')) return 0;
+    if (p == end || (d = *p - '0') > 9) return 0;
+    for (octet = 0; p < end && (d = *p - '0') <= 9; p++)
+      if ((octet = 10*octet + d) > 255) return 0;
+    value = 256*value + octet;
+  }
+
+  if (ip) *ip = value;
+  return p - s; /* #chars scanned */
+}
+
+/** Fill the table of octet strings for putip() */
+static void initoctets(void)
+{
+  int i, n;
+
+  for (i = 0; i < 256; i++) {
+    n = 0;
+    if (i >= 100) octets[i][n++] = '0' + i/100;
+    if (i >= 10) octets[i][n++] = '0' + i/10%10;
+    octets[i][n++] = '0' + i%10;
+    octets[i][3] = n;
+  }
+}
+
+/** Write ip in dotted decimal to p (which must have room for 18 chars,
+ * one more than needed) and return the end; not null terminated */
+static char *putip(char *p, uint32 ip)
+{
+  const char *o;
+  int i;
+
+  for (i = 24; i >= 0; i -= 8) {
+    o = octets[(ip >> i) & 255];
+    p[0] = o[0]; p[1] = o[1]; p[2] = o[2];
+    p += o[3];
+    if (i > 0) *p++ = '.';
+  }
+
+  return p;
+}
+
+/** Return room for n bytes at the end of obuf, flushing it first
+ * if needed; the caller then advances olen */
+static char *room(size_t n)
+{
+  if (olen + n > sizeof obuf) flushout();
+  return obuf + olen;
+}
+
+static void flushout(void)
+{
+  if (olen && !oerr && fwrite(obuf, 1, olen, stdout) != olen) oerr = 1;
+  olen = 0;
+}
+
+/** Load the prefix table from file fn: either a table file made
+ * by -C, which is mapped, or a prefix file, which is compiled */
+static int loadlpm(const char *fn)
+{
+  struct lpmhdr hdr;
+  struct stat st;
+  const char *base;
+  size_t size, i;
+  FILE *fp;
+  void *p;
+
+  if (!(fp = fopen(fn, "rb")))
+    return logup(FAILSOFT, "cannot open %s: %s", fn, strerror(errno));
+  if (fread(&hdr, sizeof hdr, 1, fp) != 1 ||
+      memcmp(hdr.magic, LPMMAGIC, sizeof hdr.magic) != 0) {
+    rewind(fp);
+    i = buildlpm(fp, fn);
+    fclose(fp);
+    return i;
+  }
+
+  if (fstat(fileno(fp), &st) != 0)
+    return logup(FAILSOFT, "cannot stat %s: %s", fn, strerror(errno));
+  size = st.st_size;
+  if (hdr.order != ORDERMARK || hdr.nblocks > size || hdr.nroutes > size ||
+      size != sizeof hdr + NTBL24*4 + (size_t) hdr.nblocks*256*4 +
+              (size_t) hdr.nroutes*sizeof(struct route) + hdr.poolsize ||
+      hdr.poolsize == 0)
+    return logup(FAILHARD, "invalid table file %s", fn);
+  p = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+  fclose(fp);
+  if (p == MAP_FAILED)
+    return logup(FAILSOFT, "cannot map %s: %s", fn, strerror(errno));
+
+  base = (const char *) p + sizeof hdr;
+  lpm.tbl24 = (const uint32 *) base;
+  lpm.tbl8 = lpm.tbl24 + NTBL24;
+  lpm.routes = (const struct route *) (lpm.tbl8 + (size_t) hdr.nblocks*256);
+  lpm.pool = (const char *) (lpm.routes + hdr.nroutes);
+  lpm.nblocks = hdr.nblocks;
+  lpm.nroutes = hdr.nroutes;
+  lpm.poolsize = hdr.poolsize;
+
+  /* lookup() checks the table entries; check routes and pool here */
+  if (lpm.pool[lpm.poolsize-1] != '\0')
+    return logup(FAILHARD, "invalid table file %s", fn);
+  for (i = 0; i < lpm.nroutes; i++)
+    if (lpm.routes[i].bits > 32 || lpm.routes[i].label >= lpm.poolsize)
+      return logup(FAILHARD, "invalid table file %s", fn);
+
+  return SUCCESS;
+}
+
+/** Compile the prefix file fp (named fn) into lpm: one prefix
+ * (addr/n, or addr for /32) per line, optionally followed by
+ * blanks and a label; empty lines and lines with # are skipped */
+static int buildlpm(FILE *fp, const char *fn)
+{
+  uint32 *tbl24, *tbl8 = 0, *order, v, e;
+  size_t nblocks = 0, maxblocks = 0, i, j, n, lo;
+  size_t count[34];
+  struct route *rp;
+
+  bld.maxpool = 4096; bld.npool = 1; bld.last = 0;
+  if (!(bld.pool = malloc(bld.maxpool)))
+    return logup(FAILSOFT, "out of memory");
+  bld.pool[0] = '\0'; /* offset 0: no label */
+
+  if (eachline(fp, addroute) || ferror(fp))
+    return logup(FAILHARD, "%s: %s", fn, ferror(fp) ? strerror(errno) : "invalid prefix file");
+
+  /* Sort routes by length (stable), then insert shorter first, so
+     that longer prefixes overwrite the shorter ones they are in */
+  if (!(order = malloc((bld.nroutes+1) * sizeof *order)) ||
+      !(tbl24 = calloc(NTBL24, sizeof *tbl24)))
+    return logup(FAILSOFT, "out of memory");
+  memset(count, 0, sizeof count);
+  for (i = 0; i < bld.nroutes; i++) count[bld.routes[i].bits+1]++;
+  for (i = 1; i < 34; i++) count[i] += count[i-1];
+  for (i = 0; i < bld.nroutes; i++) order[count[bld.routes[i].bits]++] = i;
+
+  for (j = 0; j < bld.nroutes; j++) {
+    rp = &bld.routes[order[j]];
+    v = order[j] + 1;
+    if (rp->bits <= 24) {
+      lo = rp->net >> 8;
+      n = (size_t) 1 << (24 - rp->bits);
+      for (i = lo; i < lo+n; i++) tbl24[i] = v;
+      continue;
+    }
+    e = tbl24[rp->net >> 8];
+    if (!(e & BLOCK)) { /* new block, inherit the /24's route */
+      if (nblocks == maxblocks) {
+        maxblocks = maxblocks ? 2*maxblocks : 256;
+        if (!(tbl8 = realloc(tbl8, maxblocks*256 * sizeof *tbl8)))
+          return logup(FAILSOFT, "out of memory");
+      }
+      for (i = 0; i < 256; i++) tbl8[nblocks*256+i] = e;
+      e = tbl24[rp->net >> 8] = BLOCK | nblocks++;
+    }
+    lo = (size_t) (e & ~BLOCK) * 256 + (rp->net & 255);
+    n = (size_t) 1 << (32 - rp->bits);
+    for (i = lo; i < lo+n; i++) tbl8[i] = v;
+  }
+  free(order);
+
+  while (bld.npool % 4) bld.pool[bld.npool++] = '\0';
+  lpm.tbl24 = tbl24;
+  lpm.tbl8 = tbl8;
+  lpm.routes = bld.routes;
+  lpm.pool = bld.pool;
+  lpm.nblocks = nblocks;
+  lpm.nroutes = bld.nroutes;
+  lpm.poolsize = bld.npool;
+
+  return SUCCESS;
+}
+
+/** Parse one line of a prefix file into bld; return 0 if ok */
+static int addroute(const char *s, const char *end)
+{
+  struct route *rp;
+  uint32 net;
+  unsigned bits = 0;
+  size_t n;
+  int i, j;
+
+  bld.lineno++;
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+  if (s == end || *s == '#') return 0;
+
+  if ((i = parseip4(s, end, &net)) == 0) goto bad;
+  if (s+i < end && s[i] == '/') {
+    for (j = ++i; s+i < end && s[i] >= '0' && s[i] <= '9' && i-j < 3; i++)
+      bits = 10*bits + (s[i]-'0');
+    if (i == j || bits > 32) goto bad;
+  }
+  else bits = 32;
+  if (s+i < end && s[i] != ' ' && s[i] != '\t') goto bad;
+  for (s += i; s < end && (*s == ' ' || *s == '\t'); s++) ;
+
+  if (bld.nroutes == bld.maxroutes) {
+    bld.maxroutes = bld.maxroutes ? 2*bld.maxroutes : 1024;
+    if (!(bld.routes = realloc(bld.routes, bld.maxroutes * sizeof *rp)))
+      return logup(FAILSOFT, "out of memory");
+  }
+  rp = &bld.routes[bld.nroutes++];
+  rp->net = bits ? net & ~(((uint32) 1 << (32-bits)) - 1) : 0;
+  rp->bits = bits;
+
+  /* Labels often repeat on consecutive lines: store them once */
+  n = end - s;
+  if (n && !(bld.last && strlen(bld.pool+bld.last) == n &&
+             memcmp(bld.pool+bld.last, s, n) == 0)) {
+    while (bld.npool + n + 4 > bld.maxpool)
+      if (!(bld.pool = realloc(bld.pool, bld.maxpool *= 2)))
+        return logup(FAILSOFT, "out of memory");
+    memcpy(bld.pool+bld.npool, s, n);
+    bld.pool[bld.npool+n] = '\0';
+    bld.last = bld.npool;
+    bld.npool += n+1;
+  }
+  rp->label = n ? bld.last : 0;
+  return 0;
+
+bad:
+  return logup(1, "line %ld: invalid prefix", bld.lineno);
+}
+
+/** Write the prefix table in lpm to file fn */
+static int savelpm(const char *fn)
+{
+  struct lpmhdr hdr;
+  FILE *fp;
+
+  memcpy(hdr.magic, LPMMAGIC, sizeof hdr.magic);
+  hdr.order = ORDERMARK;
+  hdr.nblocks = lpm.nblocks;
+  hdr.nroutes = lpm.nroutes;
+  hdr.poolsize = lpm.poolsize;
+
+  if (!(fp = fopen(fn, "wb")))
+    return logup(FAILSOFT, "cannot create %s: %s", fn, strerror(errno));
+  if (fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+      fwrite(lpm.tbl24, 4, NTBL24, fp) != (size_t) NTBL24 ||
+      fwrite(lpm.tbl8, 4*256, lpm.nblocks, fp) != lpm.nblocks ||
+      fwrite(lpm.routes, sizeof *lpm.routes, lpm.nroutes, fp) != lpm.nroutes ||
+      fwrite(lpm.pool, 1, lpm.poolsize, fp) != lpm.poolsize ||
+      fclose(fp) == EOF)
+    return logup(FAILSOFT, "error writing %s: %s", fn, strerror(errno));
+
+  fprintf(stderr, "(%lu prefixes, %lu blocks)\n",
+          (unsigned long) lpm.nroutes, (unsigned long) lpm.nblocks);
+  return SUCCESS;
+}
+
+/** Return route+1 for the longest prefix in lpm that contains ip,
+ * or 0 if there is none */
+static uint32 lookup(uint32 ip)
+{
+  uint32 e = lpm.tbl24[ip >> 8];
+
+  if (e & BLOCK) {
+    if ((e &= ~BLOCK) >= lpm.nblocks) return 0;
+    e = lpm.tbl8[(size_t) e*256 + (ip & 255)];
+  }
+
+  return e <= lpm.nroutes ? e : 0;
+}
+
+/** Write one record for the address in the line from s to end:
+ * address, longest matching prefix and its label (or - and -),
+ * tab separated; return 0, or 1 if the line is invalid */
+static int putmatch(const char *s, const char *end)
+{
+  const struct route *rp;
+  const char *label;
+  uint32 addr, r;
+  size_t n;
+  char *q;
+
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+  if (s == end) return 0; /* skip blank lines */
+  if (parseip4(s, end, &addr) != end-s) return putbad(s, end);
+
+  q = room(MAXREC+MAXLINE);
+  q = putip(q, addr); *q++ = '\t';
+  if ((r = lookup(addr))) {
+    rp = &lpm.routes[r-1];
+    q = putnet(q, rp->net, rp->bits); *q++ = '\t';
+    label = lpm.pool + rp->label;
+    if (!*label) *q++ = '-';
+    for (n = 0; *label && n < MAXLINE; n++) *q++ = *label++;
+  }
+  else {
+    *q++ = '-'; *q++ = '\t'; *q++ = '-';
+  }
+  *q++ = '\n';
+  olen = q - obuf;
+
+  return 0;
+}
+
+static int logup(int code, const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s: ", me);
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  return code;
+}
+
+/** Parse addr, addr/n, or addr-addr (blanks around the dash are
+ * allowed) from s to end into the range lo..hi; return 1 if ok */
+static int parserange(const char *s, const char *end, uint32 *lo, uint32 *hi)
+{
+  uint32 mask;
+  unsigned bits = 0;
+  int i, j;
+
+  if ((i = parseip4(s, end, lo)) == 0) return 0;
+  *hi = *lo;
+  if (s+i == end) return 1;
+
+  if (s[i] == '/') {
+    for (j = ++i; s+i < end && s[i] >= '0' && s[i] <= '9' && i-j < 3; i++)
+      bits = 10*bits + (s[i]-'0');
+    if (i == j || bits > 32 || s+i != end) return 0;
+    mask = bits ? ((uint32) 1 << (32-bits)) - 1 : 0xffffffff;
+    *lo &= ~mask;
+    *hi = *lo | mask;
+    return 1;
+  }
+
+  while (s+i < end && (s[i] == ' ' || s[i] == '\t')) i++;
+  if (s+i == end || s[i++] != '-') return 0;
+  while (s+i < end && (s[i] == ' ' || s[i] == '\t')) i++;
+  if ((j = parseip4(s+i, end, hi)) == 0 || s+i+j != end) return 0;
+  return *lo <= *hi;
+}
+
+/** Run set operation op ('a' union, 'i' intersection, 'd' difference)
+ * over the lists in files, left to right, and write the result as
+ * CIDRs or, with eflag, as addresses; stdin is the first operand if
+ * there is no file (-a) or just one (-i, -d) */
+static int setmain(int op, char **files, int eflag)
+{
+  struct rlist a, b, c;
+  size_t i;
+  int k, bad;
+
+  if (!files[0] || (op != 'a' && !files[1])) k = readlist(0, &a);
+  else k = readlist(*files++, &a);
+  if (k < 0) return FAILSOFT;
+  for (bad = k; *files; files++) {
+    if ((k = readlist(*files, &b)) < 0) return FAILSOFT;
+    if (setop(op, &a, &b, &c) != SUCCESS) return FAILSOFT;
+    free(a.r); free(b.r);
+    a = c; bad += k;
+  }
+
+  for (i = 0; i < a.n; i++)
+    if (eflag) putaddrs(a.r[i].lo, a.r[i].hi);
+    else putcidrs(a.r[i].lo, a.r[i].hi);
+  flushout();
+  if (oerr || fflush(stdout) == EOF) return FAILSOFT;
+  return bad ? FAILSOFT : SUCCESS;
+}
+
+/** Combine the sorted and merged lists a and b into c, likewise:
+ * op 'a' for union, 'i' for intersection, 'd' for a minus b */
+static int setop(int op, const struct rlist *a, const struct rlist *b, struct rlist *c)
+{
+  const struct range *x = a->r, *y = b->r;
+  size_t i = 0, j = 0, k;
+  uint32 cur;
+
+  memset(c, 0, sizeof *c);
+  c->max = a->n + b->n + 1; /* enough for any op */
+  if (!(c->r = malloc(c->max * sizeof *c->r)))
+    return logup(FAILSOFT, "out of memory");
+
+  if (op == 'a') /* merge by low end */
+    while (i < a->n || j < b->n)
+      c->r[c->n++] = j == b->n || (i < a->n && x[i].lo <= y[j].lo) ? x[i++] : y[j++];
+  else if (op == 'i') /* overlaps, advance the one that ends first */
+    while (i < a->n && j < b->n) {
+      c->r[c->n].lo = x[i].lo > y[j].lo ? x[i].lo : y[j].lo;
+      c->r[c->n].hi = x[i].hi < y[j].hi ? x[i].hi : y[j].hi;
+      if (c->r[c->n].lo <= c->r[c->n].hi) c->n++;
+      if (x[i].hi < y[j].hi) i++; else j++;
+    }
+  else for (; i < a->n; i++) { /* gaps that b leaves in each of a */
+    for (cur = x[i].lo; j < b->n && y[j].hi < cur; j++) ;
+    for (k = j; k < b->n && y[k].lo <= x[i].hi; k++) {
+      if (y[k].lo > cur) {
+        c->r[c->n].lo = cur;
+        c->r[c->n++].hi = y[k].lo - 1;
+      }
+      if (y[k].hi >= x[i].hi) break; /* rest of x[i] is gone */
+      cur = y[k].hi + 1;
+    }
+    if (k == b->n || y[k].lo > x[i].hi) {
+      c->r[c->n].lo = cur;
+      c->r[c->n++].hi = x[i].hi;
+    }
+  }
+
+  mergeranges(c);
+  return SUCCESS;
+}
+
+/** Read the ranges in file fn (stdin if null), one per line, into
+ * lp, sorted and merged; return the number of invalid lines (which
+ * are reported), or -1 on errors */
+static int readlist(const char *fn, struct rlist *lp)
+{
+  FILE *fp = stdin;
+  int bad;
+
+  memset(lp, 0, sizeof *lp);
+  lp->name = fn;
+  if (fn && !(fp = fopen(fn, "r")))
+    return logup(-1, "cannot open %s: %s", fn, strerror(errno));
+  rcur = lp;
+  bad = eachline(fp, addrange);
+  if (ferror(fp)) bad = logup(-1, "error reading %s: %s", fn ? fn : "stdin", strerror(errno));
+  if (fn) fclose(fp);
+  if (bad < 0 || lp->err || sortranges(lp) != SUCCESS) return -1;
+  mergeranges(lp);
+  return bad;
+}
+
+static int addrange(const char *s, const char *end)
+{
+  struct rlist *lp = rcur;
+  struct range *rp;
+
+  lp->lineno++;
+  if (lp->err) return 1;
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
+  while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+  if (s == end || *s == '#') return 0;
+
+  if (lp->n == lp->max) {
+    lp->max = lp->max ? 2*lp->max : 1024;
+    if (!(rp = realloc(lp->r, lp->max * sizeof *rp))) {
+      lp->err = 1;
+      return logup(1, "out of memory");
+    }
+    lp->r = rp;
+  }
+  rp = &lp->r[lp->n];
+  if (!parserange(s, end, &rp->lo, &rp->hi)) {
+    if (lp->name) return logup(1, "%s: line %ld: invalid address or range", lp->name, lp->lineno);
+    return logup(1, "line %ld: invalid address or range", lp->lineno);
+  }
+  lp->n++;
+  return 0;
+}
+
+/** Sort the ranges in lp by their low end: LSD radix sort,
+ * 8 bits per pass, skipping passes where all keys agree */
+static int sortranges(struct rlist *lp)
+{
+  struct range *a = lp->r, *b, *t, *tmp;
+  size_t count[256], i, sum, c;
+  int shift;
+
+  if (lp->n < 2) return SUCCESS;
+  if (!(tmp = malloc(lp->n * sizeof *tmp)))
+    return logup(FAILSOFT, "out of memory");
+
+  for (b = tmp, shift = 0; shift < 32; shift += 8) {
+    memset(count, 0, sizeof count);
+    for (i = 0; i < lp->n; i++) count[(a[i].lo >> shift) & 255]++;
+    if (count[(a[0].lo >> shift) & 255] == lp->n) continue;
+    for (i = 0, sum = 0; i < 256; i++) { c = count[i]; count[i] = sum; sum += c; }
+    for (i = 0; i < lp->n; i++) b[count[(a[i].lo >> shift) & 255]++] = a[i];
+    t = a; a = b; b = t;
+  }
+
+  if (a != lp->r) memcpy(lp->r, a, lp->n * sizeof *a);
+  free(tmp);
+  return SUCCESS;
+}
+
+/** Merge sorted ranges in lp that overlap or are adjacent */
+static void mergeranges(struct rlist *lp)
+{
+  struct range *r = lp->r;
+  size_t i, j;
+
+  for (i = 0, j = 1; j < lp->n; j++) {
+    if (r[j].lo <= r[i].hi || r[j].lo - 1 == r[i].hi) { /* no overflow */
+      if (r[j].hi > r[i].hi) r[i].hi = r[j].hi;
+    }
+    else r[++i] = r[j];
+  }
+  if (lp->n) lp->n = i+1;
+}
+
+/** Write the range lo..hi as the fewest CIDRs, one per line: at each
+ * step the largest block aligned at lo that does not pass hi */
+static void putcidrs(uint32 lo, uint32 hi)
+{
+  uint32 mask;
+  char *q;
+
+  for (;;) {
+    mask = (lo & -lo) - 1; /* hostmask of lo's alignment; ~0 for 0 */
+    while (mask > hi - lo) mask >>= 1;
+    q = room(24);
+    q = putnet(q, lo, mask ? 32 - mask2bits(mask) : 32); *q++ = '\n';
+    olen = q - obuf;
+    if ((lo | mask) == hi) break;
+    lo = (lo | mask) + 1;
+  }
+}
+
+/** Enumerate the networks and ranges in args (as for -a), each in
+ * shard i of n (contiguous parts of about equal size); with hflag,
+ * leave out network and broadcast address of networks (so /31 and
+ * /32 have none) */
+static int enumerate(char **args, int hflag, unsigned shard, unsigned nshards)
+{
+  const char *s;
+  uint32 lo, hi, size, base, rem, i = shard-1;
+
+  for (; (s = *args); args++) {
+    if (!parserange(s, s+strlen(s), &lo, &hi)) {
+      flushout();
+      return logup(FAILHARD, "invalid network or range: %s", s);
+    }
+    if (hflag && strchr(s, '/')) {
+      if (hi - lo < 3) continue;
+      lo++; hi--;
+    }
+
+    if (nshards > 1) { /* size+1 may be 2^32: base, rem of (size+1)/n */
+      size = hi - lo;
+      base = size / nshards + (size % nshards + 1 == nshards);
+      rem = (size % nshards + 1) % nshards;
+      if (base == 0 && i >= rem) continue; /* empty shard */
+      lo += i*base + (i < rem ? i : rem);
+      hi = lo + base - (i < rem ? 0 : 1);
+    }
+    putaddrs(lo, hi);
+  }
+
+  flushout();
+  if (oerr || fflush(stdout) == EOF) return FAILSOFT;
+  return SUCCESS;
+}
+
+/** Write the addresses lo..hi, one per line: a /24 at a time, the
+ * first three octets formatted once, the last from the table */
+static void putaddrs(uint32 lo, uint32 hi)
+{
+  char pre[16] = "", *q;
+  const char *o;
+  uint32 last;
+  int n, x;
+
+  for (;;) {
+    n = putip(pre, lo & ~(uint32) 255) - pre - 1; /* "a.b.c." */
+    last = (lo | 255) < hi ? lo | 255 : hi;
+    q = room(256*16);
+    for (x = lo & 255; x <= (int) (last & 255); x++) {
+      memcpy(q, pre, 12); q += n;
+      o = octets[x];
+      memcpy(q, o, 4); q += o[3];
+      *q++ = '\n';
+    }
+    olen = q - obuf;
+    if (last == hi) break;
+    lo = last + 1;
+  }
+}
+
+/** Copy stdin to stdout, finding IPv4 addresses: maximal runs of
+ * digits and dots, leading dots left out, that parse as a dotted quad
+ * (maybe followed by a period). Append to its line (before the CR of
+ * a CR LF) a tab, the address, its class, private or public, and (if
+ * bits >= 0) its network with that many bits; or with rflag, annotate
+ * in place as addr(C,private), or net/n(C,private) if bits >= 0.
+ * Lines can be any length; memory use is constant. If stdout is a
+ * terminal or pipe (as with tail -f), output is flushed after each
+ * read, so lines come out as soon as they come in. */
+static int filter(int rflag, int bits)
+{
+  static char ibuf[IOSIZE+MAXRUN];
+  char ann[MAXANN], *p, *q, *end;
+  size_t k, left = 0, nann = 0;
+  int eof = 0, inrun = 0; /* inrun: in a run already passed on */
+  int live;
+  struct stat st;
+  ssize_t n;
+  uint32 ip;
+
+  live = isatty(1) || (fstat(1, &st) == 0 && S_ISFIFO(st.st_mode));
+  while (!eof) {
+    if (live) { /* before we may wait for input */
+      flushout();
+      if (fflush(stdout) == EOF) oerr = 1;
+    }
+    while ((n = read(0, ibuf+left, IOSIZE)) < 0 && errno == EINTR) ;
+    if (n < 0) break;
+    eof = n == 0;
+    end = ibuf + left + n;
+    for (p = ibuf; p < end; p = q) {
+      if (*p == '\r' && p+1 == end && !eof) break; /* CR LF? carry over */
+      if (*p == '\n' || (*p == '\r' && (p+1 == end || p[1] == '\n'))) {
+        putraw(ann, nann); nann = 0; /* end of line: annotations, if any */
+        q = p+1;
+        if (*p == '\r' && q < end) q++;
+        putraw(p, q-p);
+        inrun = 0;
+        continue;
+      }
+      if (*p == '\r' || (*p != '.' && (*p < '0' || *p > '9'))) { /* other text */
+        for (q = p+1; q < end && *q != '\n' && *q != '\r' && *q != '.' && (*q < '0' || *q > '9'); q++) ;
+        putraw(p, q-p);
+        inrun = 0;
+        continue;
+      }
+      if (*p == '.' && !inrun) { /* dots before a run are text */
+        for (q = p+1; q < end && *q == '.'; q++) ;
+        putraw(p, q-p);
+        continue;
+      }
+      for (q = p+1; q < end && (*q == '.' || (*q >= '0' && *q <= '9')); q++) ;
+      if (q == end && !eof) { /* run may go on in next read */
+        if (!inrun && q-p <= MAXRUN) break; /* carry over */
+        putraw(p, q-p);
+        inrun = 1;
+        continue;
+      }
+      k = inrun ? 0 : parseip4(p, q, &ip);
+      inrun = 0;
+      if (k == 0 || (p+k != q && (p+k+1 != q || p[k] != '.'))) {
+        putraw(p, q-p); /* not an address */
+        continue;
+      }
+      if (rflag) {
+        char *w = room(MAXREC);
+        if (bits < 0) w = putip(w, ip);
+        else w = putnet(w, bits ? ip & ~(((uint32) 1 << (32-bits)) - 1) : 0, bits);
+        *w++ = '(';
+        w = putann(w, ip, -1, ',');
+        *w++ = ')';
+        olen = w - obuf;
+      }
+      else {
+        putraw(p, k);
+        if (nann + MAXREC <= sizeof ann) { /* else drop it */
+          ann[nann++] = '\t';
+          nann = putann(putip(ann+nann, ip), ip, bits, ' ') - ann;
+        }
+      }
+      putraw(p+k, q-p-k); /* the period, if any */
+    }
+    left = end - p;
+    memmove(ibuf, p, left);
+  }
+
+  if (n < 0) {
+    flushout();
+    return logup(FAILSOFT, "error reading stdin: %s", strerror(errno));
+  }
+  putraw(ann, nann); /* last line had no newline */
+  flushout();
+  if (oerr || fflush(stdout) == EOF) return FAILSOFT;
+  return SUCCESS;
+}
+
+/** Write sep, class, sep, private or public, and (if bits >= 0)
+ * sep and the network of ip with that many bits to p (room for 32
+ * chars) and return the end; with sep ',' leave out the first sep */
+static char *putann(char *p, uint32 ip, int bits, int sep)
+{
+  const char *s = ispriv(ip) ? "private" : "public";
+
+  if (sep != ',') *p++ = sep;
+  *p++ = getclass(ip);
+  *p++ = sep;
+  while (*s) *p++ = *s++;
+  if (bits >= 0) {
+    *p++ = sep;
+    p = putnet(p, bits ? ip & ~(((uint32) 1 << (32-bits)) - 1) : 0, bits);
+  }
+  return p;
+}
+
+/** Append n bytes at s to the output buffer */
+static void putraw(const char *s, size_t n)
+{
+  char *q;
+
+  if (n == 0) return;
+  q = room(n);
+  memcpy(q, s, n);
+  olen += n;
+}
+
+/** Write net/bits to p (room for 22 chars) and return the end */
+static char *putnet(char *p, uint32 net, int bits)
+{
+  p = putip(p, net);
+  *p++ = '/';
+  if (bits >= 10) *p++ = '0' + bits/10;
+  *p++ = '0' + bits%10;
+  return p;
+}
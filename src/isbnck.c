@@ -1,5 +1,10 @@
 /* ISBN checksum tester
  * Usage: isbnck <ISBN>
+ *    or: isbnck [-j n] < file
+ *    or: isbnck -x < text
+ *    or: isbnck -u [-c] [-m mb] < file
+ *    or: isbnck -r table [-j n] < file
+ *    or: isbnck -C RangeMessage.xml table
  * History:
  *   ujr/2002-09-25 created
  *   ujr/2020-06-30 rewrite to do ISBN-10 and ISBN-13
@@ -18,26 +23,188 @@
  * x_1 + 3 x_2 + x_3 + 3 x_4 + ... + 3 x_12 + x_13 = 0 (mod 10)
  */
 
+#define _POSIX_C_SOURCE 200809L  /* for mmap, pthreads */
+
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+#define IOSIZE (256*1024)  /* size of input and output buffers */
+#define MAXLINE 128        /* only the first MAXLINE-1 bytes are checked */
+#define CHUNKSIZE (4L*1024*1024)  /* unit of parallel checking (-j) */
+#define MAXJOBS 64         /* max threads for -j */
+#define MEMLIMIT 256       /* default megabytes for sorting (-u) */
+#define RUNBUF 4096        /* pairs buffered per run when merging (-u) */
+#define E9 1000000000UL
+
+struct tally {             /* outcome counts */
+  int checked, failed, malformed;
+};
+
+struct out {               /* buffered output */
+  FILE *fp;                /* flush to fp, or grow buf if null */
+  char *buf;
+  size_t len, size;
+};
+
+/* Parallel checking (-j): the input is mapped and cut into chunks
+   that start at the beginning of a line; workers check chunks into
+   memory and the main thread writes them out in order. Workers stay
+   at most 2*njobs chunks ahead of the writer to bound memory use. */
+struct chunk {
+  struct out out;
+  struct tally t;
+  int done;
+};
+
+struct job {
+  const char *p;           /* mapped input */
+  size_t size;             /* size of input */
+  size_t nchunks, next, written;
+  struct chunk *chunks;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* Sorting (-u): each valid ISBN is reduced to a 32-bit key: 10^9
+   for prefix 979 (0 for 978) plus the nine digits that follow; the
+   check digit is implied. Keys are radix sorted in batches that fit
+   the memory limit; when there is more than one batch, each is
+   written to a temporary file as a run of (key, count) pairs, and
+   the runs are merged. */
+struct run {
+  FILE *fp;
+  uint32 *buf;             /* 2*RUNBUF words: key, count, ... */
+  size_t i, n;             /* next pair, pairs in buf */
+};
+
+/* Range table (-r): compiled (-C) from the RangeMessage.xml of
+   the International ISBN Agency into a file that is mapped as is:
+   header, EAN prefixes, registration groups (sorted by key), rules,
+   and a pool of agency names, all words native uint32. The 7 digits
+   after the EAN prefix select a rule of the prefix, which tells the
+   length of the group; the 7 digits after the group select a rule
+   of the group, which tells the length of the registrant. */
+#define RANGEMAGIC "ISBNRNG\n"
+#define ORDERMARK 0x01020304
+
+struct rangehdr {
+  char magic[8];           /* RANGEMAGIC */
+  uint32 order;            /* ORDERMARK, to detect foreign byte order */
+  uint32 nprefixes, ngroups, nrules, poolsize;
+};
+
+struct rangeset {          /* an EAN prefix or a registration group */
+  uint32 key;              /* see rangekey() */
+  uint32 first, n;         /* its rules */
+  uint32 agency;           /* offset of name in pool */
+};
+
+struct rangerule {
+  uint32 lo, hi;           /* range of the next 7 digits */
+  uint32 len;              /* length of next element */
+};
+
+struct rangedb {           /* a mapped range table */
+  const struct rangeset *prefixes, *groups;
+  const struct rangerule *rules;
+  const char *pool;
+  uint32 nprefixes, ngroups;
+};
 
 static int scanisbn(const char *s, int digits[13]);
 static int check10(int const digits[10]);
-static int check13(int const digits[10]);
+static int check13(int const digits[13]);
+
+static int checkline(const char *s, size_t n, struct out *op, struct tally *tp);
+static int checkbuf(const char **pp, const char *end, int eof, int *copy,
+                    struct out *op, struct tally *tp);
+static void checkfile(FILE *fp, struct out *op, struct tally *tp);
+static int checkpar(struct tally *tp);
+static size_t chunkstart(const char *p, size_t size, size_t i);
+static void *worker(void *arg);
+static int scantext(FILE *fp, struct out *op);
+static int emit(const int digits[13], int n, unsigned long off, struct out *op);
+static void dedup(FILE *fp, int cflag, size_t limit, struct out *op, struct tally *tp);
+static int getkey(const char *s, size_t n, uint32 *kp, struct tally *tp);
+static uint32 *radixsort(uint32 *a, uint32 *tmp, size_t n);
+static FILE *spill(const uint32 *a, size_t n);
+static int runnext(struct run *rp);
+static void sift(struct run **heap, size_t n, size_t i);
+static void putkey(uint32 key, unsigned long count, int cflag, struct out *op);
+static void compile(const char *xmlfn, const char *fn);
+static const char *xmlnext(const char **pp, const char **textp);
+static uint32 rangekey(int prefix, int len, long group);
+static int cmpset(const void *a, const void *b);
+static void loadranges(const char *fn);
+static int findlen(const struct rangeset *sp, const int *d);
+static const char *hyphenate(const int digits[13], int n, char *buf, size_t size);
+static void putout(struct out *op, const char *s, size_t n);
+static void flushout(struct out *op);
 
-static size_t getline(char *line, size_t max);
-static void copyline();
+static unsigned njobs = 1;
+static struct rangedb *db = 0; /* range table, if -r */
 
 void die(char *msg) { fprintf(stderr, "%s\n", msg); exit(99); }
 
 int main(int argc, char *argv[])
 {
-  char line[128];
   int digits[13];
-  int n, c, i;
+  int c, i;
   int totalchecked = 0, checkfailed = 0, malformed = 0;
+  int xflag = 0, uflag = 0, cflag = 0, mb = MEMLIMIT;
+
+  for (;;) { /* options */
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+      if ((i = atoi(argv[2])) < 1) die("invalid job count");
+      njobs = i < MAXJOBS ? i : MAXJOBS;
+      argv += 2; argc -= 2; /* shift */
+    }
+    else if (argc > 1 && strcmp(argv[1], "-x") == 0) {
+      xflag = 1;
+      argv++; argc--; /* shift */
+    }
+    else if (argc > 1 && strcmp(argv[1], "-u") == 0) {
+      uflag = 1;
+      argv++; argc--; /* shift */
+    }
+    else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+      cflag = 1;
+      argv++; argc--; /* shift */
+    }
+    else if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+      loadranges(argv[2]);
+      argv += 2; argc -= 2; /* shift */
+    }
+    else if (argc > 3 && strcmp(argv[1], "-C") == 0) {
+      compile(argv[2], argv[3]);
+      return 0;
+    }
+    else if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+      if ((mb = atoi(argv[2])) < 1) die("invalid memory limit");
+      argv += 2; argc -= 2; /* shift */
+    }
+    else break;
+  }
+
+  if (xflag) { /* find ISBNs in text on stdin */
+    static char obuf[IOSIZE];
+    struct out out;
+    if (argc > 1) die("isbnck -x reads standard input only");
+    out.fp = stdout; out.buf = obuf; out.len = 0; out.size = sizeof obuf;
+    i = scantext(stdin, &out);
+    flushout(&out);
+    return i > 0 ? 0 : 1;
+  }
+  if ((uflag || cflag) && argc > 1) die("isbnck -u reads standard input only");
 
   if (argc > 1) { /* process args */
     for (i = 1; i < argc; i++) {
@@ -67,25 +234,20 @@ int main(int argc, char *argv[])
     }
   }
   else { /* process stdin */
-    while ((n = getline(line, sizeof line)) > 0) {
-      totalchecked += 1;
-      switch (scanisbn(line, digits)) {
-      case 10: c = check10(digits);
-        if (c == 0) printf("OK ");
-        else { printf("!%c ", c==11 ? 'X' : c+'0'-1); checkfailed += 1; }
-        break;
-      case 13: c = check13(digits);
-        if (c == 0) printf("OK ");
-        else { printf("!%c ", c+'0'-1); checkfailed += 1; }
-        break;
-      default:
-        printf("!! "); /* malformed */
-        malformed += 1;
-        break;
-      }
-      printf("%s", line);
-      if (line[n-1] != '\n') copyline();
+    static char obuf[IOSIZE];
+    struct out out;
+    struct tally t;
+    out.fp = stdout; out.buf = obuf; out.len = 0; out.size = sizeof obuf;
+    t.checked = t.failed = t.malformed = 0;
+    if (uflag || cflag) {
+      dedup(stdin, cflag, (size_t) mb * 1024 * 1024, &out, &t);
+      flushout(&out);
+    }
+    else if (njobs < 2 || checkpar(&t) != 0) {
+      checkfile(stdin, &out, &t);
+      flushout(&out);
     }
+    totalchecked = t.checked; checkfailed = t.failed; malformed = t.malformed;
   }
 
   fprintf(stderr, "(%d passed, %d failed, %d malformed)\n",
@@ -176,19 +338,795 @@ scanisbn(const char *s, int digits[13])
   return 0; /* malformed ISBN */
 }
 
-static size_t
-getline(char *line, size_t max)
+/** Check one line (its first n bytes, at most MAXLINE-1,
+    or up to and including a newline) and write status and line;
+    return 1 if the rest of the line must be copied (line too long
+    or cut short by a NUL byte), 0 if not, EOF on a leading NUL */
+static int
+checkline(const char *s, size_t n, struct out *op, struct tally *tp)
 {
-  return fgets(line, max, stdin) ? strlen(line) : 0;
+  char line[MAXLINE], status[3], hyph[24];
+  const char *agency = 0;
+  int digits[13];
+  int c, k = 0;
+
+  memcpy(line, s, n);
+  line[n] = '\0';
+  if ((n = strlen(line)) == 0) return EOF; /* like fgets+strlen */
+
+  tp->checked += 1;
+  status[0] = '!'; status[2] = ' ';
+  switch (k = scanisbn(line, digits)) {
+  case 10: c = check10(digits);
+    if (c == 0) status[0] = 'O', status[1] = 'K';
+    else { status[1] = c==11 ? 'X' : c+'0'-1; tp->failed += 1; }
+    break;
+  case 13: c = check13(digits);
+    if (c == 0) status[0] = 'O', status[1] = 'K';
+    else { status[1] = c+'0'-1; tp->failed += 1; }
+    break;
+  default:
+    status[1] = '!'; /* malformed */
+    tp->malformed += 1;
+    break;
+  }
+  putout(op, status, 3);
+  if (db && status[0] == 'O') { /* hyphenated ISBN, agency */
+    if (!(agency = hyphenate(digits, k, hyph, sizeof hyph))) agency = "?";
+    putout(op, hyph, strlen(hyph));
+    putout(op, "\t", 1);
+    putout(op, agency, strlen(agency));
+    putout(op, "\t", 1);
+  }
+  putout(op, line, n);
+  return line[n-1] != '\n';
 }
 
+/** Check the lines in [*pp,end) and advance *pp; unless eof,
+    stop at a line head that may continue beyond end; *copy is
+    set while the rest of a line must be copied, like copyline()
+    did; return EOF if stopped by a leading NUL, else 0 */
+static int
+checkbuf(const char **pp, const char *end, int eof, int *copy,
+         struct out *op, struct tally *tp)
+{
+  const char *p = *pp, *q;
+  size_t n;
+
+  for (;;) {
+    if (*copy) {
+      if (!(q = memchr(p, '\n', end - p))) {
+        putout(op, p, end - p);
+        p = end;
+        break;
+      }
+      putout(op, p, q + 1 - p);
+      p = q + 1; *copy = 0;
+    }
+    n = end - p < MAXLINE-1 ? end - p : MAXLINE-1;
+    if ((q = memchr(p, '\n', n))) n = q + 1 - p;
+    if (!q && n < MAXLINE-1 && !(eof && n > 0)) break;
+    if ((*copy = checkline(p, n, op, tp)) == EOF) break;
+    p += n;
+  }
+  *pp = p;
+  return *copy == EOF ? EOF : 0;
+}
 
+/** Check all lines from fp: read big buffers, find line ends
+    with memchr(3), and check only the head of each line */
 static void
-copyline()
+checkfile(FILE *fp, struct out *op, struct tally *tp)
+{
+  static char ibuf[IOSIZE];
+  const char *p = ibuf, *end = ibuf;
+  size_t n;
+  int copy = 0, eof = 0;
+
+  while (checkbuf(&p, end, eof, &copy, op, tp) != EOF && !eof) {
+    n = end - p; /* keep partial head, refill */
+    memmove(ibuf, p, n);
+    p = ibuf; end = ibuf + n;
+    n = fread(ibuf + n, 1, sizeof ibuf - n, fp);
+    if (n == 0) eof = 1;
+    end += n;
+  }
+}
+
+/** Check a large regular file on stdin on njobs threads;
+    return 1 if not applicable (nothing done), 0 if done */
+static int
+checkpar(struct tally *tp)
 {
+  pthread_t tid[MAXJOBS];
+  struct stat st;
+  struct job job;
+  struct chunk *cp;
+  off_t off;
+  size_t i;
+  unsigned t;
+  void *p;
+
+  if (fstat(0, &st) != 0 || !S_ISREG(st.st_mode)) return 1;
+  if ((off = lseek(0, 0, SEEK_CUR)) < 0 || st.st_size - off <= CHUNKSIZE) return 1;
+  if ((off_t) (size_t) st.st_size != st.st_size) return 1;
+  p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+  if (p == MAP_FAILED) return 1;
+
+  /* NUL bytes make line handling depend on earlier lines */
+  job.p = (char *) p + off; job.size = st.st_size - off;
+  if (memchr(job.p, 0, job.size)) {
+    (void) munmap(p, st.st_size);
+    return 1;
+  }
+
+  job.nchunks = (job.size + CHUNKSIZE - 1) / CHUNKSIZE;
+  job.next = job.written = 0;
+  if (!(job.chunks = calloc(job.nchunks, sizeof *job.chunks)))
+    die("out of memory");
+  pthread_mutex_init(&job.lock, 0);
+  pthread_cond_init(&job.cond, 0);
+
+  for (t = 0; t < njobs; t++)
+    if (pthread_create(&tid[t], 0, worker, &job)) break;
+  if (t == 0) die("cannot create threads");
+
+  for (i = 0; i < job.nchunks; i++) { /* write chunks in order */
+    cp = &job.chunks[i];
+    pthread_mutex_lock(&job.lock);
+    while (!cp->done) pthread_cond_wait(&job.cond, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+
+    (void) fwrite(cp->out.buf, 1, cp->out.len, stdout);
+    free(cp->out.buf);
+    tp->checked += cp->t.checked;
+    tp->failed += cp->t.failed;
+    tp->malformed += cp->t.malformed;
+
+    pthread_mutex_lock(&job.lock);
+    job.written++;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+  }
+
+  while (t > 0) pthread_join(tid[--t], 0);
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  free(job.chunks);
+  (void) munmap(p, st.st_size);
+
+  (void) lseek(0, off + job.size, SEEK_SET); /* as if read */
+  return 0;
+}
+
+/** Return start of chunk i: the first line start
+    at or after i*CHUNKSIZE (or the end of input) */
+static size_t
+chunkstart(const char *p, size_t size, size_t i)
+{
+  size_t x = i * CHUNKSIZE;
+  const char *q;
+
+  if (x == 0) return 0;
+  if (x >= size) return size;
+  q = memchr(p + x - 1, '\n', size - x + 1);
+  return q ? (size_t) (q + 1 - p) : size;
+}
+
+static void *
+worker(void *arg)
+{
+  struct job *jp = arg;
+  struct chunk *cp;
+  const char *p, *end;
+  size_t i;
+  int copy;
+
+  for (;;) {
+    pthread_mutex_lock(&jp->lock);
+    while (jp->next - jp->written >= 2 * njobs && jp->next < jp->nchunks)
+      pthread_cond_wait(&jp->cond, &jp->lock);
+    i = jp->next++;
+    pthread_mutex_unlock(&jp->lock);
+    if (i >= jp->nchunks) break;
+
+    cp = &jp->chunks[i];
+    p = jp->p + chunkstart(jp->p, jp->size, i);
+    end = jp->p + chunkstart(jp->p, jp->size, i+1);
+    cp->out.fp = 0; cp->out.buf = 0;
+    cp->out.len = cp->out.size = 0;
+    copy = 0;
+    (void) checkbuf(&p, end, 1, &copy, &cp->out, &cp->t);
+
+    pthread_mutex_lock(&jp->lock);
+    cp->done = 1;
+    pthread_cond_broadcast(&jp->cond);
+    pthread_mutex_unlock(&jp->lock);
+  }
+  return 0;
+}
+
+/** Find ISBNs in arbitrary text from fp: runs of 10 or 13 digits
+    (an ISBN-10 may end in X), optionally separated by single blanks
+    or dashes, not within a word (but maybe right after "ISBN");
+    a blank ends a run of 13 digits, or of 10 that make a valid
+    ISBN-10; write offset and digits of each valid ISBN found,
+    return number found. One pass, one byte at a time, with the
+    state carried across buffers. */
+static int
+scantext(FILE *fp, struct out *op)
+{
+  static char ibuf[4+IOSIZE]; /* 4 bytes look-behind */
+  int digits[13];
+  unsigned long off = 0;   /* offset of ibuf+4 in input */
+  unsigned long start = 0; /* offset of current run */
+  const char *p, *end;
+  int n = 0;               /* digits in current run */
+  int sep = 0;             /* run ends in a separator */
+  int skip = 0;            /* skipping rest of a word */
+  int found = 0;
+  size_t r;
   int c;
-  while ((c = getchar()) != EOF && c != '\n')
-    putchar(c);
-  if (c != EOF)
-    putchar(c);
+
+  memset(ibuf, ' ', 4);
+  while ((r = fread(ibuf+4, 1, IOSIZE, fp)) > 0) {
+    end = ibuf + 4 + r;
+    for (p = ibuf + 4; p < end; p++) {
+      if (n == 0 && !skip) { /* fast forward to next digit */
+        while ((unsigned char) (*p - '0') > 9)
+          if (++p == end) goto refill;
+      }
+      c = (unsigned char) *p;
+      if (skip) {
+        if (isalnum(c) || c == '-') continue;
+        skip = 0;
+      }
+      if (n == 0) { /* not in a run: wait for a digit */
+        if (!isdigit(c)) continue;
+        if (isalnum((unsigned char) p[-1]) && memcmp(p-4, "ISBN", 4)) {
+          skip = 1; continue;
+        }
+        start = off + (p - (ibuf + 4));
+        digits[0] = c - '0'; n = 1; sep = 0;
+        continue;
+      }
+      if (n == 10 && digits[9] == 10) { /* after the X */
+        if (isalnum(c)) skip = 1;
+        else found += emit(digits, n, start, op);
+        n = 0;
+        continue;
+      }
+      if (isdigit(c)) {
+        if (n == 13) { n = 0; skip = 1; continue; } /* too long */
+        digits[n++] = c - '0'; sep = 0;
+        continue;
+      }
+      if ((c == ' ' || c == '-') && !sep) {
+        if (c == ' ' && (n == 13 || (n == 10 && check10(digits) == 0))) {
+          found += emit(digits, n, start, op);
+          n = 0;
+        }
+        else sep = 1;
+        continue;
+      }
+      if ((c == 'X' || c == 'x') && n == 9) {
+        digits[n++] = 10;
+        continue;
+      }
+      /* end of run */
+      if (!sep && isalnum(c)) skip = 1;
+      else found += emit(digits, n, start, op);
+      n = 0;
+    }
+refill:
+    memmove(ibuf, end - 4, 4);
+    off += r;
+  }
+  if (n > 0 && !skip) found += emit(digits, n, start, op);
+
+  return found;
+}
+
+/** Write offset and digits if n digits make a valid ISBN;
+    return 1 if so, 0 if not */
+static int
+emit(const int digits[13], int n, unsigned long off, struct out *op)
+{
+  char buf[40];
+  int i, len;
+
+  if (n == 10 ? check10(digits) : n == 13 ? check13(digits) : 1) return 0;
+  len = sprintf(buf, "%lu\t", off);
+  for (i = 0; i < n; i++)
+    buf[len++] = digits[i] == 10 ? 'X' : '0' + digits[i];
+  buf[len++] = '\n';
+  putout(op, buf, len);
+  return 1;
+}
+
+/** Read lines from fp and write the distinct valid ISBNs
+    in ascending order as ISBN-13, with counts if cflag */
+static void
+dedup(FILE *fp, int cflag, size_t limit, struct out *op, struct tally *tp)
+{
+  static char ibuf[IOSIZE];
+  char *p = ibuf, *end = ibuf, *q;
+  uint32 *keys, *tmp, *a, key;
+  struct run *runs = 0, **heap;
+  size_t nkeys = 0, maxkeys, nruns = 0, i, j;
+  unsigned long count;
+  int eof = 0, skip = 0;
+  size_t n;
+
+  maxkeys = limit / (2 * sizeof *keys); /* keys and radix buffer */
+  if (maxkeys < RUNBUF) maxkeys = RUNBUF;
+  if (!(keys = malloc(maxkeys * sizeof *keys)) ||
+      !(tmp = malloc(maxkeys * sizeof *tmp))) die("out of memory");
+
+  for (;;) {
+    q = memchr(p, '\n', end - p);
+    if (q || (eof && p < end) || end - p == IOSIZE) {
+      /* a line, or the head of one too long for ibuf */
+      if (!skip && getkey(p, (q ? q : end) - p, &key, tp)) {
+        if (nkeys == maxkeys) { /* batch full: spill a run */
+          if (!(runs = realloc(runs, (nruns + 1) * sizeof *runs)))
+            die("out of memory");
+          runs[nruns++].fp = spill(radixsort(keys, tmp, nkeys), nkeys);
+          nkeys = 0;
+        }
+        keys[nkeys++] = key;
+      }
+      skip = !q;
+      p = q ? q + 1 : end;
+      continue;
+    }
+    if (eof) break;
+    n = end - p; /* keep partial line, refill */
+    memmove(ibuf, p, n);
+    p = ibuf; end = ibuf + n;
+    n = fread(end, 1, sizeof ibuf - n, fp);
+    if (n == 0) eof = 1;
+    end += n;
+  }
+
+  a = radixsort(keys, tmp, nkeys);
+  if (nruns == 0) { /* all in memory */
+    for (i = 0; i < nkeys; i = j) {
+      for (j = i + 1; j < nkeys && a[j] == a[i]; j++) ;
+      putkey(a[i], j - i, cflag, op);
+    }
+  }
+  else { /* spill last batch, merge runs */
+    if (!(runs = realloc(runs, (nruns + 1) * sizeof *runs)) ||
+        !(heap = malloc((nruns + 1) * sizeof *heap))) die("out of memory");
+    runs[nruns++].fp = spill(a, nkeys);
+    for (i = n = 0; i < nruns; i++) {
+      if (!(runs[i].buf = malloc(2 * RUNBUF * sizeof *runs[i].buf)))
+        die("out of memory");
+      runs[i].i = runs[i].n = 0;
+      if (runnext(&runs[i])) heap[n++] = &runs[i];
+    }
+    for (i = n / 2; i-- > 0; ) sift(heap, n, i);
+    while (n > 0) { /* pop equal keys, sum counts */
+      key = heap[0]->buf[2*heap[0]->i];
+      count = 0;
+      while (n > 0 && heap[0]->buf[2*heap[0]->i] == key) {
+        count += heap[0]->buf[2*heap[0]->i+1];
+        heap[0]->i++;
+        if (!runnext(heap[0])) heap[0] = heap[--n];
+        sift(heap, n, 0);
+      }
+      putkey(key, count, cflag, op);
+    }
+    for (i = 0; i < nruns; i++) { fclose(runs[i].fp); free(runs[i].buf); }
+    free(heap);
+    free(runs);
+  }
+  free(keys);
+  free(tmp);
+}
+
+/** Scan the line s (n bytes, only the head is used) and count
+    the outcome; return 1 and the key in *kp if it is a valid ISBN */
+static int
+getkey(const char *s, size_t n, uint32 *kp, struct tally *tp)
+{
+  char line[MAXLINE];
+  int digits[13];
+  uint32 key;
+  int i;
+
+  if (n > MAXLINE-1) n = MAXLINE-1;
+  memcpy(line, s, n);
+  line[n] = '\0';
+
+  tp->checked += 1;
+  switch (scanisbn(line, digits)) {
+  case 10:
+    if (check10(digits)) break;
+    for (i = 0, key = 0; i < 9; i++) key = 10 * key + digits[i];
+    *kp = key;
+    return 1;
+  case 13:
+    if (check13(digits)) break;
+    if (digits[0] != 9 || digits[1] != 7 || digits[2] < 8) {
+      tp->malformed += 1; /* not in the ISBN ranges 978, 979 */
+      return 0;
+    }
+    for (i = 3, key = 0; i < 12; i++) key = 10 * key + digits[i];
+    *kp = digits[2] == 9 ? key + E9 : key;
+    return 1;
+  default:
+    tp->malformed += 1;
+    return 0;
+  }
+  tp->failed += 1;
+  return 0;
+}
+
+/** LSD radix sort n keys, a byte at a time, skipping bytes that
+    are the same in all keys; return a or tmp, whichever is sorted */
+static uint32 *
+radixsort(uint32 *a, uint32 *tmp, size_t n)
+{
+  size_t count[256], i, sum, c;
+  uint32 *t;
+  int shift, b;
+
+  for (shift = 0; shift < 32; shift += 8) {
+    memset(count, 0, sizeof count);
+    for (i = 0; i < n; i++) count[(a[i] >> shift) & 255]++;
+    if (n == 0 || count[(a[0] >> shift) & 255] == n) continue;
+    for (b = 0, sum = 0; b < 256; b++) {
+      c = count[b]; count[b] = sum; sum += c;
+    }
+    for (i = 0; i < n; i++) tmp[count[(a[i] >> shift) & 255]++] = a[i];
+    t = a; a = tmp; tmp = t;
+  }
+  return a;
+}
+
+/** Write the n sorted keys at a as a run of (key, count)
+    pairs into a temporary file, rewound for reading */
+static FILE *
+spill(const uint32 *a, size_t n)
+{
+  uint32 pair[2];
+  size_t i, j;
+  FILE *fp;
+
+  if (!(fp = tmpfile())) die("cannot create temporary file");
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && a[j] == a[i]; j++) ;
+    pair[0] = a[i]; pair[1] = j - i;
+    if (fwrite(pair, sizeof pair, 1, fp) != 1) die("cannot write temporary file");
+  }
+  if (fflush(fp) == EOF) die("cannot write temporary file");
+  rewind(fp);
+  return fp;
+}
+
+/** Make sure the run has a pair at rp->i; return 0 if exhausted */
+static int
+runnext(struct run *rp)
+{
+  if (rp->i < rp->n) return 1;
+  rp->n = fread(rp->buf, 2 * sizeof *rp->buf, RUNBUF, rp->fp);
+  rp->i = 0;
+  return rp->n > 0;
+}
+
+/** Restore the min-heap order (by current key) below heap[i] */
+static void
+sift(struct run **heap, size_t n, size_t i)
+{
+  struct run *t;
+  size_t m;
+
+  for (;;) {
+    m = i;
+    if (2*i+1 < n && heap[2*i+1]->buf[2*heap[2*i+1]->i] < heap[m]->buf[2*heap[m]->i])
+      m = 2*i+1;
+    if (2*i+2 < n && heap[2*i+2]->buf[2*heap[2*i+2]->i] < heap[m]->buf[2*heap[m]->i])
+      m = 2*i+2;
+    if (m == i) return;
+    t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+    i = m;
+  }
+}
+
+/** Write key as ISBN-13, preceded by count and a tab if cflag */
+static void
+putkey(uint32 key, unsigned long count, int cflag, struct out *op)
+{
+  char buf[40];
+  int digits[13];
+  int i, len = 0;
+
+  digits[0] = 9; digits[1] = 7; digits[2] = key >= E9 ? 9 : 8;
+  if (key >= E9) key -= E9;
+  for (i = 11; i >= 3; i--) { digits[i] = key % 10; key /= 10; }
+  digits[12] = 0;
+  if ((i = check13(digits))) digits[12] = i - 1;
+
+  if (cflag) len = sprintf(buf, "%lu\t", count);
+  for (i = 0; i < 13; i++) buf[len++] = '0' + digits[i];
+  buf[len++] = '\n';
+  putout(op, buf, len);
+}
+
+/** Compile the range message in file xmlfn into table file fn */
+static void
+compile(const char *xmlfn, const char *fn)
+{
+  struct rangehdr hdr;
+  struct rangeset *sets = 0, *sp = 0;
+  struct rangerule *rules = 0;
+  size_t nsets = 0, nrules = 0, npool = 1, maxpool = 1024, n, i;
+  const char *p, *tag, *text, *dash;
+  char *xml, *pool;
+  long size, lo = 0, hi = 0;
+  int ngroup, inrule = 0, isgroup = 0;
+  FILE *fp;
+
+  if (!(fp = fopen(xmlfn, "rb"))) die("cannot open range message");
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0) die("cannot read range message");
+  rewind(fp);
+  if (!(xml = malloc(size + 1)) || !(pool = malloc(maxpool))) die("out of memory");
+  if (fread(xml, 1, size, fp) != (size_t) size) die("cannot read range message");
+  xml[size] = '\0';
+  fclose(fp);
+  pool[0] = '\0'; /* offset 0: no name */
+
+  for (p = xml; (tag = xmlnext(&p, &text)); ) {
+    if (!strcmp(tag, "EAN.UCC") || !strcmp(tag, "Group")) {
+      if (!(sets = realloc(sets, (nsets + 1) * sizeof *sets))) die("out of memory");
+      sp = &sets[nsets++];
+      sp->key = 0; sp->first = nrules; sp->n = 0; sp->agency = 0;
+      isgroup = tag[0] == 'G'; inrule = 0;
+    }
+    else if (!sp) continue; /* still in the header */
+    else if (!strcmp(tag, "Prefix")) { /* "978", or "978-0" for a group */
+      dash = strchr(text, '-');
+      if (strncmp(text, "97", 2) || (text[2] != '8' && text[2] != '9') ||
+          isgroup != !!dash) die("bad prefix in range message");
+      ngroup = dash ? strlen(dash + 1) : 0;
+      if (isgroup && (ngroup < 1 || ngroup > 5)) die("bad prefix in range message");
+      sp->key = isgroup ? rangekey(text[2] - '0', ngroup, atol(dash + 1))
+                        : (uint32) (970 + text[2] - '0');
+    }
+    else if (!strcmp(tag, "Agency")) {
+      n = strlen(text) + 1;
+      while (npool + n + 4 > maxpool)
+        if (!(pool = realloc(pool, maxpool *= 2))) die("out of memory");
+      memcpy(pool + npool, text, n);
+      sp->agency = npool; npool += n;
+    }
+    else if (!strcmp(tag, "Range")) {
+      if (sscanf(text, "%ld-%ld", &lo, &hi) != 2 || lo > hi) die("bad range in range message");
+      inrule = 1;
+    }
+    else if (!strcmp(tag, "Length") && inrule) {
+      inrule = 0;
+      if ((n = atoi(text)) > 7) die("bad length in range message");
+      if (n == 0) continue; /* range not in use: leave it out */
+      if (!(rules = realloc(rules, (nrules + 1) * sizeof *rules))) die("out of memory");
+      rules[nrules].lo = lo; rules[nrules].hi = hi;
+      rules[nrules].len = n;
+      nrules++; sp->n++;
+    }
+  }
+
+  /* Prefixes (keys below 1000) first, then groups by key */
+  qsort(sets, nsets, sizeof *sets, cmpset);
+  for (n = 0; n < nsets && sets[n].key < 1000; n++) ;
+  for (i = 1; i < nsets; i++)
+    if (sets[i].key == sets[i-1].key) die("duplicate prefix in range message");
+  if (n == 0 || n == nsets) die("no prefixes or no groups in range message");
+  while (npool % 4) pool[npool++] = '\0';
+
+  memcpy(hdr.magic, RANGEMAGIC, sizeof hdr.magic);
+  hdr.order = ORDERMARK;
+  hdr.nprefixes = n; hdr.ngroups = nsets - n;
+  hdr.nrules = nrules; hdr.poolsize = npool;
+
+  if (!(fp = fopen(fn, "wb"))) die("cannot create range table");
+  if (fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+      fwrite(sets, sizeof *sets, nsets, fp) != nsets ||
+      fwrite(rules, sizeof *rules, nrules, fp) != nrules ||
+      fwrite(pool, 1, npool, fp) != npool || fclose(fp) == EOF)
+    die("cannot write range table");
+  fprintf(stderr, "(%lu prefixes, %lu groups, %lu rules)\n",
+          (unsigned long) n, (unsigned long) (nsets - n), (unsigned long) nrules);
+
+  free(xml); free(pool); free(sets); free(rules);
+}
+
+/** Find the next start tag from *pp on and return its name; set
+    *textp to the text that follows it, with entities decoded; both
+    in static buffers (long text is cut); return null at the end */
+static const char *
+xmlnext(const char **pp, const char **textp)
+{
+  static const char *ents[] = { "&amp;", "&lt;", "&gt;", "&quot;", "&apos;" };
+  static char tag[32], text[256];
+  const char *p = *pp;
+  size_t n, i;
+
+  do { /* skip end tags, declarations, comments */
+    if (!(p = strchr(p, '<'))) return 0;
+  } while (*++p == '/' || *p == '?' || *p == '!');
+
+  n = strcspn(p, " \t\r\n/>");
+  if (n >= sizeof tag) n = sizeof tag - 1;
+  memcpy(tag, p, n);
+  tag[n] = '\0';
+  if (!(p = strchr(p, '>'))) return 0;
+
+  for (n = 0, p++; *p && *p != '<' && n < sizeof text - 1; n++) {
+    for (i = 0; i < 5 && (*p != '&' || strncmp(p, ents[i], strlen(ents[i]))); i++) ;
+    if (i < 5) { text[n] = "&<>\"'"[i]; p += strlen(ents[i]); }
+    else text[n] = *p++;
+  }
+  text[n] = '\0';
+
+  *textp = text;
+  *pp = p;
+  return tag;
+}
+
+/** Key of a group: its EAN prefix (last digit 8 or 9), length, digits */
+static uint32
+rangekey(int prefix, int len, long group)
+{
+  return (uint32) (prefix - 8) << 24 | (uint32) len << 20 | (uint32) group;
+}
+
+static int
+cmpset(const void *a, const void *b)
+{
+  uint32 x = ((const struct rangeset *) a)->key;
+  uint32 y = ((const struct rangeset *) b)->key;
+  return x < y ? -1 : x > y;
+}
+
+/** Map the range table in file fn and make it the current one */
+static void
+loadranges(const char *fn)
+{
+  static struct rangedb rdb;
+  const struct rangehdr *hp;
+  const struct rangeset *sp;
+  struct stat st;
+  size_t size, nsets, i, j;
+  uint32 maxlen;
+  void *p;
+  int fd;
+
+  if ((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+    die("cannot open range table");
+  size = st.st_size;
+  if (size < sizeof *hp) die("invalid range table");
+  if ((p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    die("cannot map range table");
+  (void) close(fd);
+
+  hp = p;
+  nsets = (size_t) hp->nprefixes + hp->ngroups;
+  if (memcmp(hp->magic, RANGEMAGIC, sizeof hp->magic) ||
+      hp->order != ORDERMARK || nsets > size || hp->nrules > size ||
+      size != sizeof *hp + nsets * sizeof *sp +
+              hp->nrules * sizeof *rdb.rules + hp->poolsize ||
+      hp->poolsize == 0 || ((const char *) p)[size-1] != '\0')
+    die("invalid range table");
+
+  rdb.prefixes = (const struct rangeset *) (hp + 1);
+  rdb.groups = rdb.prefixes + hp->nprefixes;
+  rdb.rules = (const struct rangerule *) (rdb.groups + hp->ngroups);
+  rdb.pool = (const char *) (rdb.rules + hp->nrules);
+  rdb.nprefixes = hp->nprefixes;
+  rdb.ngroups = hp->ngroups;
+  for (i = 0, sp = rdb.prefixes; i < nsets; i++, sp++) {
+    if (sp->first > hp->nrules || sp->n > hp->nrules - sp->first ||
+        sp->agency >= hp->poolsize) die("invalid range table");
+    /* group: 1..7 digits of the 9 after the prefix; registrant:
+       at least one digit left after it for the publication */
+    maxlen = i < hp->nprefixes ? 7 : 8 - (sp->key >> 20 & 15);
+    if (i >= hp->nprefixes && (maxlen < 1 || maxlen > 7)) die("invalid range table");
+    for (j = 0; j < sp->n; j++)
+      if (rdb.rules[sp->first + j].len == 0 ||
+          rdb.rules[sp->first + j].len > maxlen) die("invalid range table");
+  }
+  db = &rdb;
+}
+
+/** Return the length the rules of set sp give for the 7 digits
+    at d, 0 if none */
+static int
+findlen(const struct rangeset *sp, const int *d)
+{
+  const struct rangerule *rp = db->rules + sp->first;
+  uint32 v = 0, i;
+
+  for (i = 0; i < 7; i++) v = 10 * v + d[i];
+  for (i = 0; i < sp->n; i++, rp++)
+    if (rp->lo <= v && v <= rp->hi) return rp->len;
+  return 0;
+}
+
+/** Write the valid ISBN in digits (n is 10 or 13) into buf (of
+    size bytes, at least 14), hyphenated per the range table; return
+    the name of its group's agency, or null (and digits only in buf)
+    if it is not in a range in use */
+static const char *
+hyphenate(const int digits[13], int n, char *buf, size_t size)
+{
+  const struct rangeset *sp = 0;
+  int d[20], lens[5], i, j, k, len;
+  size_t lo, hi, mid;
+  uint32 key;
+  long group;
+
+  for (i = 0; i < n; i++) buf[i] = digits[i] == 10 ? 'X' : '0' + digits[i];
+  buf[n] = '\0';
+
+  /* As ISBN-13, padded for the 7-digit windows */
+  if (n == 10) { d[0] = 9; d[1] = 7; d[2] = 8; }
+  else for (i = 0; i < 3; i++) d[i] = digits[i];
+  for (i = 0; i < 10; i++) d[i+3] = digits[i + (n == 13 ? 3 : 0)];
+  for (i = 13; i < 20; i++) d[i] = 0;
+
+  for (i = 0; i < (int) db->nprefixes; i++)
+    if (db->prefixes[i].key == (uint32) (970 + d[2])) sp = &db->prefixes[i];
+  if (!sp || (len = findlen(sp, d + 3)) < 1 || len > 7) return 0;
+  for (i = 0, group = 0; i < len; i++) group = 10 * group + d[3+i];
+  key = rangekey(d[2], len, group);
+
+  for (lo = 0, hi = db->ngroups, sp = 0; lo < hi; ) { /* binary search */
+    mid = lo + (hi - lo) / 2;
+    if (db->groups[mid].key < key) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == db->ngroups || db->groups[lo].key != key) return 0;
+  sp = &db->groups[lo];
+
+  lens[0] = 3; lens[1] = len; /* prefix, group, registrant, publication, check */
+  if ((lens[2] = findlen(sp, d + 3 + len)) < 1 || lens[2] > 8 - len) return 0;
+  lens[3] = 9 - len - lens[2];
+  lens[4] = 1;
+  for (i = n == 13 ? 0 : 1, k = 0; i < 5; i++) k += lens[i] + 1;
+  if ((size_t) k > size) return 0; /* no room (k counts the NUL) */
+
+  for (i = n == 13 ? 0 : 1, j = 0, k = 0; i < 5; i++) {
+    if (k > 0) buf[k++] = '-';
+    for (len = 0; len < lens[i]; len++) buf[k++] = '0' + d[j++ + (n == 10 ? 3 : 0)];
+  }
+  if (digits[n-1] == 10) buf[k-1] = 'X';
+  buf[k] = '\0';
+
+  return db->pool + sp->agency;
+}
+
+static void
+putout(struct out *op, const char *s, size_t n)
+{
+  if (op->len + n > op->size && !op->fp) { /* grow */
+    size_t size = op->size ? op->size : IOSIZE;
+    while (op->len + n > size) size *= 2;
+    if (!(op->buf = realloc(op->buf, size))) die("out of memory");
+    op->size = size;
+  }
+  if (op->len + n > op->size) {
+    flushout(op);
+    if (n >= op->size) { (void) fwrite(s, 1, n, op->fp); return; }
+  }
+  memcpy(op->buf + op->len, s, n);
+  op->len += n;
+}
+
+static void
+flushout(struct out *op)
+{
+  if (op->len > 0) (void) fwrite(op->buf, 1, op->len, op->fp);
+  op->len = 0;
 }
@@ -1,39 +1,76 @@
 /* mkpwd - generate initial random passwords
  * Usage: mkpwd [-VD] [-N num] {-<c><alphabet>} [spec]
  * Want: -R randfile to read random bytes from eg /dev/random
+ *   (random bytes now come from getrandom or /dev/urandom)
  * History: ujr/2004-10-30 created
  * License: GNU General Public License (GPL)
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE  /* for getrandom */
+#endif
+
 #include <ctype.h>   /* isdigit */
+#include <errno.h>
+#include <fcntl.h>   /* open */
 #include <stdio.h>
 #include <stdlib.h>  /* getenv */
 #include <string.h>  /* strlen */
-#include <time.h>    /* time */
-#include <unistd.h>  /* getpid */
+#include <unistd.h>  /* read */
+
+#ifdef __linux__
+#include <sys/random.h>  /* getrandom */
+#endif
 
 #include "common.h"
 
+#define RNDBUF 4096   /* keystream bytes computed at a time */
+#define OUTBUF 65536  /* output buffer size */
+
+/* The spec is compiled once into a list of ops, run per password:
+   a literal run (alen 0) copies n chars from s, a random op picks
+   n chars from alphabet s (alen chars, rejection threshold t) */
+struct op {
+  const char *s;
+  int n;
+  size_t alen;
+  unsigned t;
+};
+
 static char id[] = "mkpwd by ujr/2004-10-30\n";
 
 int identity(void);
 int usage(const char *s);
-void generate(const char *alph[], const char *spec);
+struct op *compile(const char *alph[], const char *spec, int *nops, int *total);
+void generate(const struct op *ops, int nops, int total);
 int setalph(int i, char *s);
 int getint(const char *s, int *val);
-void putr(int n, const char *s);
 void putn(const char *s, int n);
+char *room(int n);
+int flushout(void);
 
-void rndseed(unsigned seed);
-unsigned rnd(unsigned lo, unsigned hi);
+int rndinit(void);
+void rndrefill(void);
+void rndpick(char *dst, int n, const char *a, size_t alen, unsigned t);
 
 char *me = "mkpwd";
 const char *alph[26]; /* the 26 alphabets */
 
+char obuf[OUTBUF];    /* passwords go here before stdout */
+int olen;             /* bytes in obuf */
+int oerr;             /* true after a write error */
+
+uint32 kst[16];               /* ChaCha20 state, random key */
+unsigned long kctr;           /* next keystream block */
+unsigned char kbuf[RNDBUF];   /* keystream */
+int kpos = RNDBUF;            /* next unused byte in kbuf */
+
 int main(int argc, char **argv)
 {
   int c, num = 1, debug = 0;
   const char *spec = 0; /* pwd spec; 0 means "8z" */
+  struct op *ops;
+  int nops, total;
 
   /* Initialise alphabets */
   for (c = 0; c < 26; c++) alph[c] = 0;
@@ -67,13 +104,24 @@ endargs:
   if (!spec) spec = getenv("MKPWDSPEC");
   if (spec && *spec == '\0') spec = 0;
 
-  rndseed((unsigned) time(NULL) + getpid());
+  if (rndinit() != 0) {
+    fprintf(stderr, "%s: cannot get random seed: %s\n", me, strerror(errno));
+    return FAILHARD;
+  }
 
   if (debug) for (c = 0; c < 26; c++) if (alph[c])
     fprintf(stderr, "%c: %s\n", c+'a', alph[c]); /* XXX */
 
-  while (num--) generate(alph, spec);
+  if (!(ops = compile(alph, spec, &nops, &total))) {
+    fprintf(stderr, "%s: out of memory\n", me);
+    return FAILHARD;
+  }
+  while (num--) generate(ops, nops, total);
 
+  if (flushout() != 0) {
+    fprintf(stderr, "%s: write error: %s\n", me, strerror(errno));
+    return FAILHARD;
+  }
   return SUCCESS;
 }
 
@@ -96,21 +144,73 @@ int usage(const char *errmsg)
   return errmsg ? FAILHARD : SUCCESS;
 }
 
-void generate(const char *alph[], const char *spec)
+/** Compile spec (0 means "8z") into a list of ops, with the newline
+ * at the end; set *nops and *total, the chars per password, or
+ * OUTBUF+1 if more (so it cannot overflow) */
+struct op *compile(const char *alph[], const char *spec, int *nops, int *total)
 {
-  if (spec) while (*spec) {
-    if (isdigit(*spec)) { int c, n;
-      c = getint(spec, &n);
-      if (c && n && islower(spec[c]))
-        putr(n, alph[spec[c]-'a']), spec++;
-      else putn(spec, c);
-      spec += c;
+  struct op *ops, *op;
+  char *lit;
+  const char *a;
+  int c, n;
+
+  if (!spec) spec = "8z";
+  n = strlen(spec);
+  if (!(ops = malloc((n+1) * sizeof *ops)) || !(lit = malloc(n+1)))
+    return 0;
+
+  for (op = ops, op->n = 0, *total = 0; ; ) {
+    c = isdigit(*spec) ? getint(spec, &n) : 0;
+    if (c && n && islower(spec[c])) { /* random op */
+      a = alph[spec[c]-'a'];
+      spec += c+1;
+      if (!a || !*a) continue; /* no chars from empty alphabet */
+      if (op->n) op++; /* end literal run */
+      op->s = a;
+      op->n = n;
+      op->alen = strlen(a);
+      if (op->alen > 65536) op->alen = 65536; /* use the first 64K chars */
+      op->t = op->alen <= 256 ? 256 % op->alen : 65536 % op->alen;
+      *total = n > OUTBUF - *total ? OUTBUF+1 : *total + n;
+      (++op)->n = 0;
+      continue;
     }
-    else putc(*spec++, stdout);
+    if (!c) c = 1; /* copy a digit run or one char as is */
+    if (!op->n) { op->s = lit; op->alen = 0; op->t = 0; }
+    memcpy(lit, *spec ? spec : "\n", c);
+    lit += c; op->n += c;
+    *total = c > OUTBUF - *total ? OUTBUF+1 : *total + c;
+    if (!*spec) break; /* that was the newline */
+    spec += c;
   }
-  else putr(8, alph[25]); /* default spec */
 
-  putc('\n', stdout);
+  *nops = op+1 - ops;
+  return ops;
+}
+
+/** Write one password by running the nops ops; if all of it (total
+ * chars) fits in obuf, without per-op checks */
+void generate(const struct op *ops, int nops, int total)
+{
+  const struct op *op, *end = ops + nops;
+  char *q;
+  int k, n;
+
+  if (total <= OUTBUF) {
+    q = room(total);
+    for (op = ops; op < end; q += op->n, op++)
+      if (op->alen) rndpick(q, op->n, op->s, op->alen, op->t);
+      else memcpy(q, op->s, op->n);
+    olen += total;
+  }
+  else for (op = ops; op < end; op++) {
+    if (!op->alen) putn(op->s, op->n);
+    else for (n = op->n; n > 0; n -= k) { /* in pieces that fit obuf */
+      k = n < OUTBUF ? n : OUTBUF;
+      rndpick(room(k), k, op->s, op->alen, op->t);
+      olen += k;
+    }
+  }
 }
 
 int getint(const char *s, int *val)
@@ -131,33 +231,110 @@ int setalph(int i, char *s)
   return 1; /* OK */
 }
 
-void putr(int n, const char *a)
+void putn(const char *s, int n)
 {
-  int alen;
-  if (!a || !*a) return;
-  alen = strlen(a) - 1;
-  while (n-- > 0) putc(a[rnd(0,alen)], stdout);
+  int k;
+
+  if (s) while (n > 0) {
+    k = n < OUTBUF ? n : OUTBUF;
+    memcpy(room(k), s, k);
+    olen += k;
+    s += k; n -= k;
+  }
 }
 
-void putn(const char *s, int n)
+/** Return room for n <= OUTBUF bytes at the end of obuf, flushing
+ * it if needed; the caller then advances olen */
+char *room(int n)
 {
-  if (s && n > 0) fwrite(s, 1, n, stdout);
+  if (olen + n > OUTBUF) flushout();
+  return obuf + olen;
 }
 
-/* Quick+Dirty random numbers
- *
- * Based on chapter 7.1 in Numerical Recipes in C (www.nr.com).
- * It is a linear congruential generator with the constants m (modulus),
- * a (multiplier), and c (increment) taken from the table on page 285.
+int flushout(void)
+{
+  if (olen && !oerr && fwrite(obuf, 1, olen, stdout) != (size_t) olen) oerr = 1;
+  olen = 0;
+  if (!oerr && fflush(stdout) == EOF) oerr = 1;
+  return oerr ? -1 : 0;
+}
+
+/* Random numbers
  *
- * TODO Find better constants for 8bit randoms; adjust types.
+ * A ChaCha20 keystream (see chacha.c) under a 256-bit key from the
+ * kernel: getrandom(2) where there is one, else /dev/urandom. The
+ * kernel is asked once; the keystream is computed RNDBUF bytes at
+ * a time and consumed by rejection sampling (see rndpick).
  */
-static unsigned long r = 1;
-void rndseed(unsigned seed) { r = seed; }
 
-unsigned rnd(unsigned lo, unsigned hi)
+int rndinit(void)
+{
+  unsigned char seed[32];
+  size_t n = 0;
+  ssize_t r;
+  int fd;
+
+#ifdef __linux__
+  while (n < sizeof seed) {
+    if ((r = getrandom(seed+n, sizeof seed - n, 0)) > 0) n += r;
+    else if (r < 0 && errno == EINTR) continue;
+    else break; /* e.g. ENOSYS: try the device */
+  }
+#endif
+  if (n < sizeof seed) {
+    if ((fd = open("/dev/urandom", O_RDONLY)) < 0) return -1;
+    for (n = 0; n < sizeof seed; n += r)
+      if ((r = read(fd, seed+n, sizeof seed - n)) <= 0) {
+        if (r < 0 && errno == EINTR) { r = 0; continue; }
+        if (r == 0) errno = EIO;
+        close(fd);
+        return -1;
+      }
+    close(fd);
+  }
+
+  chachakey(kst, seed);
+  memset(seed, 0, sizeof seed);
+  kctr = 0;
+  kpos = RNDBUF;
+  return 0;
+}
+
+void rndrefill(void)
 {
-  static unsigned a=9301, c=49297, m=233280;
-  r = (r * a + c) % m;
-  return lo + ((hi-lo+1)*r)/m;
+  int i;
+
+  for (i = 0; i < RNDBUF; i += 64)
+    chachablock(kst, kctr++, kbuf+i);
+  kpos = 0;
+}
+
+/** Write n chars drawn uniformly from a (alen chars) to dst. Draw
+ * a byte b (two for alen > 256), take the high byte of b*alen as
+ * index, but reject b if the low byte is below t = 256 % alen (or
+ * 65536 % alen): then each index has the same number of b (Lemire's
+ * method, without a division per char). */
+void rndpick(char *dst, int n, const char *a, size_t alen, unsigned t)
+{
+  unsigned long m;
+  int k; /* local copy of kpos: stores to dst might alias it */
+
+  if (alen <= 256) {
+    while (n > 0) {
+      if (kpos == RNDBUF) rndrefill();
+      for (k = kpos; k < RNDBUF && n > 0; k++) {
+        m = kbuf[k] * (unsigned long) alen;
+        if ((m & 255) >= t) *dst++ = a[m >> 8], n--;
+      }
+      kpos = k;
+    }
+  }
+  else {
+    while (n > 0) {
+      if (kpos + 2 > RNDBUF) rndrefill();
+      m = (kbuf[kpos] << 8 | kbuf[kpos+1]) * (unsigned long) alen;
+      kpos += 2;
+      if ((m & 65535) >= t) *dst++ = a[m >> 16], n--;
+    }
+  }
 }
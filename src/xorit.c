@@ -1,9 +1,12 @@
 /* xorit - xor input against a string
- * Usage: xorit [-hvV] [-f file ] [string]
+ * Usage: xorit [-hvV] [-f file | -s seed] [-o offset] [-j n] [string]
+ *    or: xorit -i file [-c checkpoint] [-f file | -s seed] [-o offset] [-j n] [string]
  * History: ujr/2003-06-02 created
  * License: GNU General Public License (GPL)
  */
 
+#define _POSIX_C_SOURCE 200809L  /* for posix_madvise */
+
 #include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -11,30 +14,94 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "common.h"
 
 static char id[] = "xorit by ujr/2003-06-02\n";
 
+#define IOSIZE 65536  /* size of I/O buffer */
+#define XBLOCK 4096   /* expand shorter keys to at least this size */
+#define CHUNK (1024L*1024)  /* unit of parallel xoring (-j) */
+#define MAXJOBS 64    /* max threads for -j */
+#define CKBLOCK 4096  /* unit of checkpoint hashes (-c) */
+#define NCKBLK (CHUNK/CKBLOCK)
+#define KSBLOCK 4096  /* keystream computed per call (-s) */
+#define KSPERIOD ((size_t) -1 / 64 * 64)  /* keystream "length" (-s) */
+
+/* Pipeline for -j: a reader thread fills the slots of a ring
+   in turn, the workers xor them, and the main thread writes
+   them out in order and hands them back to the reader */
+enum { FREE, FULL, BUSY, DONE };
+
+struct slot {
+  char *buf;          /* CHUNK bytes */
+  size_t len;         /* bytes of data in buf */
+  size_t xpos;        /* key position of first byte */
+  int state;          /* FREE, FULL, BUSY, DONE */
+};
+
+struct ring {
+  struct slot *slots;
+  unsigned nslots;
+  unsigned long nread, nxor, nwritten; /* chunks so far */
+  int eof;            /* reader done */
+  int errnum;         /* errno of read error, 0 if none */
+  int quit;           /* writer failed, stop */
+  const char *x;      /* key */
+  size_t xlen, xpos;  /* key length, position of next chunk */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* In-place xoring (-i): workers pread, xor, and pwrite chunks
+   of the file; with a checkpoint file, chunks are written in
+   order, and before each write, the chunks before are synced
+   to disk and the checkpoint records (and syncs) the chunk's
+   offset and hashes of its original blocks, so that on resume
+   a chunk that was partly written can be put back together */
+struct job {
+  int fd, ckfd;       /* file, checkpoint file (or -1) */
+  off_t size;         /* size of file */
+  unsigned long nchunks, next, committed;
+  int errnum;         /* errno of first failure, 0 if none */
+  const char *x;      /* key */
+  size_t xlen, xpos;  /* key length, position at file offset 0 */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
 int identity(void);
 int usage(const char *errmsg);
-void xorit(char *buf, size_t len, const char *x, size_t xlen);
+size_t xorit(char *s, size_t slen, const char *x, size_t xlen, size_t xpos);
+void xorblk(char *s, const char *x, size_t n);
+size_t xorks(char *s, size_t slen, size_t xlen, size_t xpos);
+void seedks(const char *seed);
+const char *xexpand(const char *x, size_t *lenp);
 const char *xload(const char *fn, size_t *lenp);
+int xorpar(const char *x, size_t xlen, size_t xpos);
+int xorfile(const char *fn, const char *ckfn,
+            const char *x, size_t xlen, size_t xpos);
 int logup(int code, const char *fmt, ...);
 
 char *progname = "xorit";
 int verbose = 0;
+unsigned njobs = 1;
+uint32 kstate[16]; /* ChaCha20 state for the keystream (-s) */
 
 int main(int argc, char **argv)
 {
   int c;
-  const char *fn = 0;
+  const char *fn = 0, *seed = 0;
+  const char *ifn = 0, *ckfn = 0;
   const char *x = 0;
-  size_t xlen;
+  size_t xlen, xpos;
   ssize_t r;
-  unsigned long n;
-  char buf[BUFSIZ];
+  unsigned long n, off = 0;
+  char *end;
+  static char buf[IOSIZE];
 
   (void) argc; /* unused */
   if (*argv && **argv) progname = *argv;
@@ -43,6 +110,22 @@ args: while (*++argv && (**argv == '-')) {
     while ((c = *++argv[0])) switch (c) {
       case 'f': if ((fn = *++argv)) goto args;
                 return usage("missing argument");
+      case 's': if ((seed = *++argv)) goto args;
+                return usage("missing argument");
+      case 'i': if ((ifn = *++argv)) goto args;
+                return usage("missing argument");
+      case 'c': if ((ckfn = *++argv)) goto args;
+                return usage("missing argument");
+      case 'o': if (!*++argv) return usage("missing argument");
+                off = strtoul(*argv, &end, 10);
+                if (**argv && !*end) goto args;
+                return usage("invalid offset");
+      case 'j': if (!*++argv) return usage("missing argument");
+                njobs = strtoul(*argv, &end, 10);
+                if (!**argv || *end) return usage("invalid job count");
+                if (njobs < 1) njobs = 1;
+                if (njobs > MAXJOBS) njobs = MAXJOBS;
+                goto args;
       case 'v': verbose = 1; break;
       case 'V': return identity();
       case 'h': return usage(0);
@@ -53,24 +136,35 @@ args: while (*++argv && (**argv == '-')) {
 endargs:
   if (*argv) x = *argv++, xlen = strlen(x);
   if (*argv) return usage("too many arguments");
+  if (ckfn && !ifn) return usage("checkpoint requires -i");
+  if (seed && (x || fn)) return usage("seed and key are exclusive");
 
-  if (!x) {
+  if (seed) {
+    seedks(seed); /* x stays null */
+    xlen = KSPERIOD;
+    if (verbose) logup(0, "keystream from seed");
+  }
+  else if (!x) {
     if (fn) {
       x = xload(fn, &xlen); /* load from xor file */
       if (!x)
         return logup(FAILSOFT, "cannot load xor file %s: %s", fn, strerror(errno));
       if (verbose)
-        logup(0, "%ld bytes read from xor file %s", xlen, fn);
+        logup(0, "%lu bytes in xor file %s", (unsigned long) xlen, fn);
     }
     else x = "\377", xlen = 1; /* default: hex FF */
   }
   if (xlen < 1) return logup(FAILHARD, "xor file/string length must be at least 1");
+  xpos = off % xlen;
+  if (x) x = xexpand(x, &xlen);
+  if (ifn) return xorfile(ifn, ckfn, x, xlen, xpos);
+  if (njobs > 1) return xorpar(x, xlen, xpos);
 
   r = 1; n = 0;
   while (r > 0) {
     if ((r = read(0, buf, sizeof buf)) < 0)
       return logup(FAILSOFT, "error reading stdin: %s", strerror(errno));
-    xorit(buf, r, x, xlen);  n += r;
+    xpos = xorit(buf, r, x, xlen, xpos);  n += r;
     if (write(1, buf, r) != r)
       return logup(FAILSOFT, "error writing stdout: %s", strerror(errno));
   }
@@ -86,61 +180,469 @@ int identity(void)
 
 int usage(const char *errmsg)
 {
-  const char *args = "[-hvV] [-f file] [string]";
+  const char *args = "[-hvV] [-f file | -s seed] [-o offset] [-j n] [string]";
+  const char *args2 = "-i file [-c checkpoint] [-f file | -s seed] [-o offset] [-j n] [string]";
   if (errmsg) {
     fprintf(stderr, "%s: %s\n", progname, errmsg);
     fprintf(stderr, "Usage: %s %s\n", progname, args);
+    fprintf(stderr, "   or: %s %s\n", progname, args2);
   }
   else {
     fprintf(stdout, "Xor standard input against a string\n");
     fprintf(stdout, "Usage: %s %s\n", progname ,args);
+    fprintf(stdout, "   or: %s %s\n", progname, args2);
   }
   return errmsg ? FAILHARD : SUCCESS;
 }
 
-/** xor s in-place against x (repeated if necessary) */
-void xorit(char *s, size_t slen, const char *x, size_t xlen)
+/** xor s against the key x (or the keystream if x is null),
+    starting at key position xpos; return next key position */
+size_t xorit(char *s, size_t slen, const char *x, size_t xlen, size_t xpos)
 {
-  register char *sp;
-  register const char *xp = x;
-  register const char *xend = x + xlen;
+  size_t n;
 
-  for (sp = s; slen > 0; slen--) {
-    *sp++ ^= *xp++;
-    if (xp >= xend) xp = x;
+  if (!x) return xorks(s, slen, xlen, xpos);
+  while (slen > 0) {
+    n = xlen - xpos;
+    if (n > slen) n = slen;
+    xorblk(s, x + xpos, n);
+    s += n; slen -= n;
+    if ((xpos += n) == xlen) xpos = 0;
   }
+  return xpos;
 }
 
-/** alloc xbuf and load file fn into it, return #bytes, -1 on error*/
+/** xor n bytes at s in-place against n bytes at x,
+    four machine words at a time while possible */
+void xorblk(char *s, const char *x, size_t n)
+{
+  const size_t w = sizeof(unsigned long);
+  unsigned long a, b, c, d, t;
+
+  for (; n >= 4*w; n -= 4*w, s += 4*w, x += 4*w) {
+    memcpy(&a, s, w); memcpy(&t, x, w); a ^= t;
+    memcpy(&b, s+w, w); memcpy(&t, x+w, w); b ^= t;
+    memcpy(&c, s+2*w, w); memcpy(&t, x+2*w, w); c ^= t;
+    memcpy(&d, s+3*w, w); memcpy(&t, x+3*w, w); d ^= t;
+    memcpy(s, &a, w); memcpy(s+w, &b, w);
+    memcpy(s+2*w, &c, w); memcpy(s+3*w, &d, w);
+  }
+  while (n-- > 0) *s++ ^= *x++;
+}
+
+/** xor s against the keystream, in blocks computed as needed
+    from the 64-byte block at xpos on; return next position */
+size_t xorks(char *s, size_t slen, size_t xlen, size_t xpos)
+{
+  unsigned char ks[KSBLOCK];
+  size_t n, skip, i;
+
+  while (slen > 0) {
+    skip = xpos % 64;
+    n = KSBLOCK - skip;
+    if (n > slen) n = slen;
+    if (n > xlen - xpos) n = xlen - xpos;
+    for (i = 0; i < skip + n; i += 64)
+      chachablock(kstate, (xpos - skip + i) / 64, ks + i);
+    xorblk(s, (char *) ks + skip, n);
+    s += n; slen -= n;
+    if ((xpos += n) == xlen) xpos = 0;
+  }
+  return xpos;
+}
+
+/** set up the keystream: fold the seed into a 256-bit key,
+    32 bytes at a time, mixing after each with one block */
+void seedks(const char *seed)
+{
+  unsigned char key[64];
+  size_t i;
+
+  memset(key, 0, sizeof key);
+  do {
+    for (i = 0; i < 32 && seed[i]; i++) key[i] ^= seed[i];
+    seed += i;
+    chachakey(kstate, key);
+    chachablock(kstate, 0, key);
+  } while (*seed);
+  chachakey(kstate, key);
+}
+
+/** repeat a short key so that each xorblk() call gets a long
+    run; a whole number of repetitions keeps the key phase */
+const char *xexpand(const char *x, size_t *lenp)
+{
+  size_t i, n, xlen = *lenp;
+  char *xbuf;
+
+  if (xlen >= XBLOCK) return x;
+  n = (XBLOCK + xlen - 1) / xlen * xlen;
+  if (!(xbuf = malloc(n))) return x; /* just use short key */
+  for (i = 0; i < n; i += xlen) memcpy(xbuf + i, x, xlen);
+
+  *lenp = n;
+  return xbuf;
+}
+
+void *reader(void *arg)
+{ /* fill free slots from stdin, in ring order, until EOF */
+  struct ring *rp = arg;
+  struct slot *sp;
+  size_t len;
+  ssize_t r;
+
+  for (r = 1; r > 0; ) {
+    pthread_mutex_lock(&rp->lock);
+    sp = &rp->slots[rp->nread % rp->nslots];
+    while (sp->state != FREE && !rp->quit)
+      pthread_cond_wait(&rp->cond, &rp->lock);
+    pthread_mutex_unlock(&rp->lock);
+    if (rp->quit) break;
+
+    for (len = 0; len < CHUNK; len += r)
+      if ((r = read(0, sp->buf + len, CHUNK - len)) <= 0) break;
+
+    pthread_mutex_lock(&rp->lock);
+    if (r < 0) rp->errnum = errno;
+    if (len > 0 && !rp->errnum) {
+      sp->len = len; sp->xpos = rp->xpos;
+      sp->state = FULL; rp->nread++;
+      rp->xpos = (rp->xpos + len) % rp->xlen;
+    }
+    if (r <= 0) rp->eof = 1;
+    pthread_cond_broadcast(&rp->cond);
+    pthread_mutex_unlock(&rp->lock);
+  }
+  return 0;
+}
+
+void *worker(void *arg)
+{ /* xor full slots until the reader is done */
+  struct ring *rp = arg;
+  struct slot *sp;
+
+  for (;;) {
+    pthread_mutex_lock(&rp->lock);
+    while (rp->nxor == rp->nread && !rp->eof && !rp->quit)
+      pthread_cond_wait(&rp->cond, &rp->lock);
+    if (rp->nxor == rp->nread || rp->quit) {
+      pthread_mutex_unlock(&rp->lock);
+      break;
+    }
+    sp = &rp->slots[rp->nxor++ % rp->nslots];
+    sp->state = BUSY;
+    pthread_mutex_unlock(&rp->lock);
+
+    (void) xorit(sp->buf, sp->len, rp->x, rp->xlen, sp->xpos);
+
+    pthread_mutex_lock(&rp->lock);
+    sp->state = DONE;
+    pthread_cond_broadcast(&rp->cond);
+    pthread_mutex_unlock(&rp->lock);
+  }
+  return 0;
+}
+
+/** xor stdin to stdout on njobs threads, overlapping
+    reading, xoring, and writing; return exit code */
+int xorpar(const char *x, size_t xlen, size_t xpos)
+{
+  pthread_t tid[MAXJOBS+1];
+  struct ring ring;
+  struct slot *sp;
+  unsigned i, t;
+  unsigned long n = 0;
+  char *mem;
+  int code = SUCCESS;
+
+  ring.nslots = 2 * njobs;
+  ring.slots = malloc(ring.nslots * sizeof *ring.slots);
+  mem = malloc(ring.nslots * CHUNK);
+  if (!ring.slots || !mem)
+    return logup(FAILSOFT, "cannot allocate buffers: %s", strerror(errno));
+  for (i = 0; i < ring.nslots; i++) {
+    ring.slots[i].buf = mem + i * CHUNK;
+    ring.slots[i].state = FREE;
+  }
+  ring.nread = ring.nxor = ring.nwritten = 0;
+  ring.eof = ring.errnum = ring.quit = 0;
+  ring.x = x; ring.xlen = xlen; ring.xpos = xpos;
+  pthread_mutex_init(&ring.lock, 0);
+  pthread_cond_init(&ring.cond, 0);
+
+  if ((errno = pthread_create(&tid[0], 0, reader, &ring)))
+    return logup(FAILSOFT, "cannot create thread: %s", strerror(errno));
+  for (t = 1; t <= njobs; t++)
+    if (pthread_create(&tid[t], 0, worker, &ring)) break;
+  if (t == 1) /* no workers */
+    return logup(FAILSOFT, "cannot create thread: %s", strerror(errno));
+
+  for (;;) { /* write done slots in order */
+    pthread_mutex_lock(&ring.lock);
+    sp = &ring.slots[ring.nwritten % ring.nslots];
+    while (sp->state != DONE && !(ring.eof && ring.nwritten == ring.nread))
+      pthread_cond_wait(&ring.cond, &ring.lock);
+    pthread_mutex_unlock(&ring.lock);
+    if (sp->state != DONE) break;
+
+    if (write(1, sp->buf, sp->len) != (ssize_t) sp->len) {
+      code = logup(FAILSOFT, "error writing stdout: %s", strerror(errno));
+      pthread_mutex_lock(&ring.lock);
+      ring.quit = 1;
+      pthread_cond_broadcast(&ring.cond);
+      pthread_mutex_unlock(&ring.lock);
+      break;
+    }
+    n += sp->len;
+
+    pthread_mutex_lock(&ring.lock);
+    sp->state = FREE; ring.nwritten++;
+    pthread_cond_broadcast(&ring.cond);
+    pthread_mutex_unlock(&ring.lock);
+  }
+
+  if (code != SUCCESS) return code; /* reader may be stuck in read */
+  while (t > 0) pthread_join(tid[--t], 0);
+  if (ring.errnum)
+    return logup(FAILSOFT, "error reading stdin: %s", strerror(ring.errnum));
+  if (verbose) logup(0, "processed %lu bytes", n);
+
+  pthread_cond_destroy(&ring.cond);
+  pthread_mutex_destroy(&ring.lock);
+  free(mem);
+  free(ring.slots);
+  return SUCCESS;
+}
+
+uint32 fnv(const char *s, size_t n)
+{ /* 32-bit FNV-1a hash */
+  uint32 h = 2166136261UL;
+  while (n-- > 0) h = ((h ^ (unsigned char) *s++) * 16777619UL) & 0xFFFFFFFFUL;
+  return h;
+}
+
+int preadn(int fd, char *buf, size_t n, off_t off)
+{ /* read exactly n bytes at off; 0 if ok, -1 on error */
+  ssize_t r;
+  for (; n > 0; buf += r, n -= r, off += r)
+    if ((r = pread(fd, buf, n, off)) <= 0) {
+      if (r == 0) errno = EIO; /* file shrunk */
+      return -1;
+    }
+  return 0;
+}
+
+int pwriten(int fd, const char *buf, size_t n, off_t off)
+{ /* write exactly n bytes at off; 0 if ok, -1 on error */
+  ssize_t r;
+  for (; n > 0; buf += r, n -= r, off += r)
+    if ((r = pwrite(fd, buf, n, off)) < 0) return -1;
+  return 0;
+}
+
+int failjob(struct job *jp, int errnum)
+{ /* record first failure and wake everybody up */
+  pthread_mutex_lock(&jp->lock);
+  if (!jp->errnum) jp->errnum = errnum ? errnum : EIO;
+  pthread_cond_broadcast(&jp->cond);
+  pthread_mutex_unlock(&jp->lock);
+  return -1;
+}
+
+void *inplace(void *arg)
+{ /* xor chunks of the file in place until none are left */
+  struct job *jp = arg;
+  char ck[24 + 9*NCKBLK];
+  uint32 h[NCKBLK];
+  unsigned long i;
+  size_t len, o, k;
+  off_t off;
+  char *buf;
+
+  if (!(buf = malloc(CHUNK))) { failjob(jp, errno); return 0; }
+
+  for (;;) {
+    pthread_mutex_lock(&jp->lock);
+    i = jp->errnum ? jp->nchunks : jp->next++;
+    pthread_mutex_unlock(&jp->lock);
+    if (i >= jp->nchunks) break;
+
+    off = (off_t) i * CHUNK;
+    len = jp->size - off < CHUNK ? jp->size - off : CHUNK;
+    if (preadn(jp->fd, buf, len, off) != 0) { failjob(jp, errno); break; }
+    if (jp->ckfd >= 0)
+      for (o = 0; o < len; o += CKBLOCK)
+        h[o/CKBLOCK] = fnv(buf + o, len - o < CKBLOCK ? len - o : CKBLOCK);
+    (void) xorit(buf, len, jp->x, jp->xlen,
+                 (jp->xpos + (size_t) (off % jp->xlen)) % jp->xlen);
+
+    if (jp->ckfd >= 0) { /* wait for our turn, then checkpoint */
+      pthread_mutex_lock(&jp->lock);
+      while (jp->committed != i && !jp->errnum)
+        pthread_cond_wait(&jp->cond, &jp->lock);
+      pthread_mutex_unlock(&jp->lock);
+      if (jp->errnum) break;
+      k = sprintf(ck, "%020lu", (unsigned long) off);
+      for (o = 0; o < len; o += CKBLOCK)
+        k += sprintf(ck + k, " %08lx", (unsigned long) h[o/CKBLOCK]);
+      ck[k++] = '\n';
+      if (fdatasync(jp->fd) != 0 || pwriten(jp->ckfd, ck, k, 0) != 0 ||
+          fdatasync(jp->ckfd) != 0) { failjob(jp, errno); break; }
+    }
+
+    if (pwriten(jp->fd, buf, len, off) != 0) { failjob(jp, errno); break; }
+
+    if (jp->ckfd >= 0) {
+      pthread_mutex_lock(&jp->lock);
+      jp->committed++;
+      pthread_cond_broadcast(&jp->cond);
+      pthread_mutex_unlock(&jp->lock);
+    }
+  }
+
+  free(buf);
+  return 0;
+}
+
+/** return the chunk where to resume according to the checkpoint,
+    0 if there is none, -1 if it does not match the file, -2 on
+    errors; blocks of that chunk already xored are xored back */
+long resume(struct job *jp)
+{
+  char ck[64 + 9*NCKBLK], *p, *buf;
+  unsigned long off, h[NCKBLK];
+  size_t len, o, n, nh = 0;
+  ssize_t r;
+  long i = -1;
+  int back = 0;
+
+  if ((r = pread(jp->ckfd, ck, sizeof ck - 1, 0)) <= 0) return r < 0 ? -2 : 0;
+  ck[r] = '\0';
+  off = strtoul(ck, &p, 10);
+  if (p == ck || off % CHUNK || (off_t) off >= jp->size) return -1;
+  while (*p == ' ' && nh < NCKBLK) h[nh++] = strtoul(p+1, &p, 16);
+  len = jp->size - off < CHUNK ? jp->size - off : CHUNK;
+  if (*p != '\n' || nh != (len + CKBLOCK - 1) / CKBLOCK) return -1;
+
+  if (!(buf = malloc(len))) return -2;
+  if (preadn(jp->fd, buf, len, off) != 0) { free(buf); return -2; }
+  for (o = 0; o < len; o += n) { /* each block original or xored */
+    n = len - o < CKBLOCK ? len - o : CKBLOCK;
+    if (fnv(buf + o, n) == h[o/CKBLOCK]) continue;
+    (void) xorit(buf + o, n, jp->x, jp->xlen,
+                 (jp->xpos + (size_t) ((off + o) % jp->xlen)) % jp->xlen);
+    if (fnv(buf + o, n) != h[o/CKBLOCK]) break;
+    back = 1;
+  }
+  if (o >= len) { /* chunk back to original, redo it */
+    i = off / CHUNK;
+    if (back && (pwriten(jp->fd, buf, len, off) != 0 || fdatasync(jp->fd) != 0))
+      i = -2;
+  }
+  free(buf);
+  return i;
+}
+
+/** xor file fn in place on njobs threads, resuming from
+    checkpoint file ckfn if given; return exit code */
+int xorfile(const char *fn, const char *ckfn,
+            const char *x, size_t xlen, size_t xpos)
+{
+  pthread_t tid[MAXJOBS];
+  struct stat st;
+  struct job job;
+  unsigned t;
+  long i;
+
+  if ((job.fd = open(fn, O_RDWR)) < 0 || fstat(job.fd, &st) != 0)
+    return logup(FAILSOFT, "cannot open %s: %s", fn, strerror(errno));
+  if (!S_ISREG(st.st_mode))
+    return logup(FAILHARD, "not a regular file: %s", fn);
+  job.ckfd = -1;
+  if (ckfn && (job.ckfd = open(ckfn, O_RDWR|O_CREAT, 0666)) < 0)
+    return logup(FAILSOFT, "cannot open %s: %s", ckfn, strerror(errno));
+
+  job.size = st.st_size;
+  job.nchunks = (job.size + CHUNK - 1) / CHUNK;
+  job.x = x; job.xlen = xlen; job.xpos = xpos;
+  job.errnum = 0;
+  job.next = 0;
+
+  if (job.ckfd >= 0) {
+    if ((i = resume(&job)) == -2)
+      return logup(FAILSOFT, "cannot resume from %s: %s", ckfn, strerror(errno));
+    if (i < 0)
+      return logup(FAILHARD, "checkpoint %s does not match %s", ckfn, fn);
+    if (i > 0 && verbose)
+      logup(0, "resuming at offset %lu", (unsigned long) i * CHUNK);
+    job.next = i;
+  }
+  job.committed = job.next;
+  pthread_mutex_init(&job.lock, 0);
+  pthread_cond_init(&job.cond, 0);
+
+  for (t = 0; t < njobs; t++)
+    if ((errno = pthread_create(&tid[t], 0, inplace, &job))) break;
+  if (t == 0) job.errnum = errno;
+  while (t > 0) pthread_join(tid[--t], 0);
+
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  if (job.errnum)
+    return logup(FAILSOFT, "error xoring %s: %s", fn, strerror(job.errnum));
+  if ((job.ckfd >= 0 && fdatasync(job.fd) != 0) || close(job.fd) != 0)
+    return logup(FAILSOFT, "error closing %s: %s", fn, strerror(errno));
+  if (job.ckfd >= 0) { (void) close(job.ckfd); (void) unlink(ckfn); }
+  if (verbose) logup(0, "processed %lu bytes", (unsigned long) job.size);
+  return SUCCESS;
+}
+
+/** map file fn into memory (or, failing that, load it into
+    a malloc'd buffer), return address, NULL on error */
 const char *xload(const char *fn, size_t *lenp)
 {
   struct stat stbuf;
   char *xbuf;
-  size_t xlen;
+  size_t xlen, n;
   ssize_t r;
+  void *p;
   int fd;
 
   *lenp = 0;
 
-  if (stat(fn, &stbuf) != 0) return NULL;
+  if ((fd = open(fn, O_RDONLY)) < 0) return NULL;
+  if (fstat(fd, &stbuf) != 0) goto fail;
 
-  xlen = /*(stbuf.st_size > 32767) ? 32767 :*/ stbuf.st_size;
-  if (!(xbuf = malloc(xlen))) return NULL;
+  xlen = stbuf.st_size;
+  if ((off_t) xlen != stbuf.st_size) { errno = EFBIG; goto fail; }
+  if (xlen == 0) { (void) close(fd); return ""; }
 
-  if ((fd = open(fn, O_RDONLY)) < 0) {
-    free(xbuf);
-    return NULL;
+  /* Mapping the key keeps memory use constant: pages are read
+     as the data proceeds and are easily dropped again */
+  p = mmap(0, xlen, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p != MAP_FAILED) {
+    (void) posix_madvise(p, xlen, POSIX_MADV_SEQUENTIAL);
+    (void) close(fd);
+    *lenp = xlen;
+    return p;
   }
 
-  if ((r = read(fd, xbuf, xlen)) < 0 || (size_t) r < xlen) {
-    free(xbuf);
-    return NULL;
+  if (!(xbuf = malloc(xlen))) goto fail;
+  for (n = 0; n < xlen; n += r) {
+    if ((r = read(fd, xbuf + n, xlen - n)) <= 0) {
+      if (r == 0) errno = EIO; /* file shrunk */
+      free(xbuf);
+      goto fail;
+    }
   }
 
   (void) close(fd);
-
   *lenp = xlen;
   return xbuf;
+
+fail:
+  (void) close(fd);
+  return NULL;
 }
 
 /** format and write message to stderr, return given code */
@@ -0,0 +1,50 @@
+/* zcopy - zero-copy output into pipes
+ * On Linux, data can be moved into a pipe without copying:
+ * splice(2) from a file.
+ * Elsewhere, ispipe() always says no and callers write(2).
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE  /* for splice */
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
+#include "common.h"
+
+/** Return 1 if fd is a pipe that we can splice into, 0 otherwise */
+int ispipe(int fd)
+{
+#ifdef __linux__
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#else
+  (void) fd; /* unused */
+  return 0;
+#endif
+}
+
+/** Move n bytes at offset off of file fd into pipe pfd,
+    return #bytes moved (less than n on error) */
+size_t zsplice(int pfd, int fd, off_t off, size_t n)
+{
+#ifdef __linux__
+  loff_t o = off;
+  size_t done;
+  ssize_t r;
+
+  for (done = 0; done < n; done += r)
+    if ((r = splice(fd, &o, pfd, 0, n - done, SPLICE_F_MORE)) <= 0) break;
+  return done;
+#else
+  (void) pfd; (void) fd; (void) off; (void) n; /* unused */
+  errno = ENOSYS;
+  return 0;
+#endif
+}